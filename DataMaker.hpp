@@ -24,17 +24,16 @@ public:
         load_data(baseFile, data, N, dim);
         load_data(queryFile, query, M, dim);
 
-        std::ifstream file(dataFile);
-        key = new int[N];
-        value = new int[N];
+        size_t attrNum;
+        if(!load_attributes(dataFile, key, value, attrNum) || attrNum < (size_t) N){
+            std::cout << "attribute file error" << std::endl;
+            exit(-1);
+        }
         valueList = new int[N];
 
         qRange.resize(M);
         ans.resize(M);
         for(int i = 0; i < N; i++){
-            int tmp;
-            file>>key[i]>>tmp;
-            value[i] = tmp;
             valueList[i] = value[i];
         }
         std::sort(valueList, valueList + N);
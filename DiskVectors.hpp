@@ -0,0 +1,154 @@
+#ifndef RANGEHNSW_DISKVECTORS_HPP
+#define RANGEHNSW_DISKVECTORS_HPP
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DISK_VECTORS_BLOCK 4096
+
+// Fixed size rows of a file region read on demand, for vectors that do not fit in memory.
+// The file is opened with O_DIRECT where the file system allows it, so reads bypass the page
+// cache. fetch hands the rows of a batch to a pool of reader threads and reads along itself,
+// so a batch costs about one read latency instead of one per row.
+class DiskVectorStore {
+public:
+    DiskVectorStore(const std::string &location, size_t offset, size_t rowSize, size_t readers = 16):
+            offset_(offset), rowSize_(rowSize) {
+        fd_ = open(location.c_str(), O_RDONLY | O_DIRECT);
+        direct_ = fd_ >= 0;
+        if(fd_ < 0) fd_ = open(location.c_str(), O_RDONLY);
+        if(fd_ < 0)
+            throw std::runtime_error("Cannot open file " + location);
+        if(!direct_) posix_fadvise(fd_, 0, 0, POSIX_FADV_RANDOM);
+        for(size_t i = 0; i < readers; i++) readers_.emplace_back([this] { readerLoop(); });
+    }
+
+    ~DiskVectorStore(){
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        pending_.notify_all();
+        for(std::thread &t : readers_) t.join();
+        close(fd_);
+    }
+
+    size_t rowSize() const { return rowSize_; }
+
+    // reads rows ids[0..n) to out, rowSize() bytes each
+    void fetch(const unsigned int *ids, size_t n, char *out) const {
+        if(n == 0) return;
+        Batch batch{ids, out, n};
+        if(readers_.empty() || n == 1){
+            work(batch);
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            queue_.push_back(&batch);
+        }
+        pending_.notify_all();
+        work(batch);
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_.wait(lock, [&] { return batch.done == batch.n && batch.readers == 0; });
+        auto pos = std::find(queue_.begin(), queue_.end(), &batch);
+        if(pos != queue_.end()) queue_.erase(pos);
+        if(batch.failed)
+            throw std::runtime_error("Cannot read vectors from disk");
+    }
+
+private:
+    struct Batch{
+        const unsigned int *ids;
+        char *out;
+        size_t n;
+        std::atomic<size_t> next{0}, done{0};
+        size_t readers = 0;         // reader threads working on the batch, guarded by mutex_
+        std::atomic<bool> failed{false};
+
+        Batch(const unsigned int *ids, char *out, size_t n): ids(ids), out(out), n(n) {}
+    };
+
+    int fd_;
+    bool direct_;
+    size_t offset_, rowSize_;
+    std::vector<std::thread> readers_;
+    mutable std::mutex mutex_;
+    mutable std::condition_variable pending_, finished_;
+    mutable std::deque<Batch *> queue_;
+    bool stop_{false};
+
+    // claims and reads rows of the batch until none is left
+    void work(Batch &batch) const {
+        size_t i, read = 0;
+        while((i = batch.next++) < batch.n){
+            if(!readRow(batch.ids[i], batch.out + i * rowSize_)) batch.failed = true;
+            read++;
+        }
+        batch.done += read;
+    }
+
+    void readerLoop(){
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(true){
+            pending_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+            if(stop_) return;
+            // every idle reader joins the oldest batch that still has unclaimed rows
+            Batch *batch = queue_.front();
+            if(batch->next >= batch->n){
+                queue_.pop_front();
+                continue;
+            }
+            batch->readers++;
+            lock.unlock();
+            work(*batch);
+            lock.lock();
+            batch->readers--;
+            finished_.notify_all();
+        }
+    }
+
+    bool readRow(unsigned int id, char *out) const {
+        size_t begin = offset_ + (size_t) id * rowSize_;
+        if(!direct_) return readAll(out, rowSize_, begin);
+        // O_DIRECT reads whole aligned blocks into an aligned buffer
+        size_t first = begin / DISK_VECTORS_BLOCK * DISK_VECTORS_BLOCK;
+        size_t last = (begin + rowSize_ + DISK_VECTORS_BLOCK - 1) / DISK_VECTORS_BLOCK * DISK_VECTORS_BLOCK;
+        thread_local std::vector<char> scratch;
+        if(scratch.size() < last - first + DISK_VECTORS_BLOCK) scratch.resize(last - first + DISK_VECTORS_BLOCK);
+        char *buffer = (char *) (((uintptr_t) scratch.data() + DISK_VECTORS_BLOCK - 1) & ~(uintptr_t) (DISK_VECTORS_BLOCK - 1));
+        if(!readAll(buffer, last - first, first, begin + rowSize_ - first)) return false;
+        memcpy(out, buffer + (begin - first), rowSize_);
+        return true;
+    }
+
+    // reads size bytes at offset, a short read at the end of the file is fine past need bytes
+    bool readAll(char *out, size_t size, size_t offset, size_t need = 0) const {
+        if(need == 0) need = size;
+        size_t got = 0;
+        while(got < need){
+            ssize_t n = pread(fd_, out + got, size - got, offset + got);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) return false;
+            got += n;
+        }
+        return true;
+    }
+};
+
+
+#endif //RANGEHNSW_DISKVECTORS_HPP
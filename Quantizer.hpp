@@ -0,0 +1,322 @@
+#ifndef RANGEHNSW_QUANTIZER_HPP
+#define RANGEHNSW_QUANTIZER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <numeric>
+#include <stdexcept>
+
+#if defined(__AVX__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+// Scalar quantizer with one byte per dimension: x[i] ~ vmin[i] + scale[i] * code[i].
+// Query distances are asymmetric, the query stays in float and is only shifted by vmin.
+class SQ8Quantizer {
+public:
+    explicit SQ8Quantizer(size_t dim): dim_(dim), vmin_(dim, 0), scale_(dim, 0) {}
+
+    // reads what serialize wrote
+    SQ8Quantizer(size_t dim, const char *data, size_t size): dim_(dim), vmin_(dim), scale_(dim) {
+        if(size != 2 * dim * sizeof(float))
+            throw std::runtime_error("Quantizer seems to be corrupted or unsupported");
+        memcpy(vmin_.data(), data, dim * sizeof(float));
+        memcpy(scale_.data(), data + dim * sizeof(float), dim * sizeof(float));
+    }
+
+    void train(const float *data, size_t n){
+        std::vector<float> vmax(dim_, -std::numeric_limits<float>::max());
+        std::fill(vmin_.begin(), vmin_.end(), std::numeric_limits<float>::max());
+        for(size_t i = 0; i < n; i++){
+            const float *vec = data + i * dim_;
+            for(size_t j = 0; j < dim_; j++){
+                vmin_[j] = std::min(vmin_[j], vec[j]);
+                vmax[j] = std::max(vmax[j], vec[j]);
+            }
+        }
+        for(size_t j = 0; j < dim_; j++){
+            if(n == 0) vmin_[j] = vmax[j] = 0;
+            scale_[j] = (vmax[j] - vmin_[j]) / 255.0f;
+        }
+    }
+
+    void encode(const float *vec, uint8_t *code) const {
+        for(size_t j = 0; j < dim_; j++){
+            float c = scale_[j] > 0 ? std::round((vec[j] - vmin_[j]) / scale_[j]) : 0;
+            code[j] = (uint8_t) std::min(255.0f, std::max(0.0f, c));
+        }
+    }
+
+    // prepared needs dim() floats
+    void prepare(const float *query, float *prepared) const {
+        for(size_t j = 0; j < dim_; j++) prepared[j] = query[j] - vmin_[j];
+    }
+
+    float distance(const float *prepared, const uint8_t *code) const {
+        const float *scale = scale_.data();
+        size_t j = 0;
+        float res = 0;
+#if defined(__AVX__)
+        __m256 sum = _mm256_setzero_ps();
+        for(; j + 8 <= dim_; j += 8){
+            __m128i c8 = _mm_loadl_epi64((const __m128i *) (code + j));
+            __m128i lo = _mm_cvtepu8_epi32(c8);
+            __m128i hi = _mm_cvtepu8_epi32(_mm_srli_si128(c8, 4));
+            __m256 c = _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+            __m256 t = _mm256_sub_ps(_mm256_loadu_ps(prepared + j), _mm256_mul_ps(_mm256_loadu_ps(scale + j), c));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(t, t));
+        }
+        alignas(32) float tmp[8];
+        _mm256_store_ps(tmp, sum);
+        res = tmp[0] + tmp[1] + tmp[2] + tmp[3] + tmp[4] + tmp[5] + tmp[6] + tmp[7];
+#endif
+        for(; j < dim_; j++){
+            float t = prepared[j] - scale[j] * code[j];
+            res += t * t;
+        }
+        return res;
+    }
+
+    size_t dim() const { return dim_; }
+
+    size_t codeSize() const { return dim_; }
+
+    // vmin followed by scale
+    std::vector<char> serialize() const {
+        std::vector<char> data(2 * dim_ * sizeof(float));
+        memcpy(data.data(), vmin_.data(), dim_ * sizeof(float));
+        memcpy(data.data() + dim_ * sizeof(float), scale_.data(), dim_ * sizeof(float));
+        return data;
+    }
+
+private:
+    size_t dim_;
+    std::vector<float> vmin_, scale_;
+};
+
+// Product quantizer: a vector is cut into m sub-vectors, each stored as the index of the nearest
+// of 2^nbits centroids of its subspace. nbits is 8 (one byte per sub-vector) or 4 (two per byte,
+// the low nibble holding the even sub-vector). Distances are asymmetric, through per query
+// tables of the distances from each query sub-vector to every centroid. With 4 bit codes the
+// tables are quantized to bytes so that a batch of 16 codes is scored with byte shuffles.
+class PQQuantizer {
+public:
+    // per query state, reused between queries so that preparing a query does not allocate
+    struct QueryTable{
+        std::vector<float> table;        // m * ksub distances
+        std::vector<uint8_t> lut;        // table quantized to bytes, 4 bit codes only
+        std::vector<uint8_t> block;      // 16 transposed codes being scored
+        float bias, scale;               // distance = bias + scale * sum of lut entries
+    };
+
+    PQQuantizer(size_t dim, size_t m, int nbits): dim_(dim), m_(m), nbits_(nbits) {
+        init();
+    }
+
+    // reads what serialize wrote
+    PQQuantizer(size_t dim, const char *data, size_t size): dim_(dim) {
+        int header[2];
+        if(size < sizeof(header))
+            throw std::runtime_error("Quantizer seems to be corrupted or unsupported");
+        memcpy(header, data, sizeof(header));
+        m_ = header[0];
+        nbits_ = header[1];
+        init();
+        if(size != sizeof(header) + centroids_.size() * sizeof(float))
+            throw std::runtime_error("Quantizer seems to be corrupted or unsupported");
+        memcpy(centroids_.data(), data + sizeof(header), centroids_.size() * sizeof(float));
+    }
+
+    // k-means in every subspace over at most maxTrain sampled vectors
+    void train(const float *data, size_t n, size_t maxTrain = 65536, int iters = 20){
+        std::mt19937 rng(1234);
+        std::vector<size_t> sample(n);
+        std::iota(sample.begin(), sample.end(), 0);
+        if(n > maxTrain){
+            for(size_t i = 0; i < maxTrain; i++) std::swap(sample[i], sample[i + rng() % (n - i)]);
+            sample.resize(maxTrain);
+        }
+        size_t ns = sample.size();
+        if(ns == 0) return;
+
+        std::vector<float> sub(ns * dsub_);
+        std::vector<int> assign(ns);
+        std::vector<float> sums(ksub_ * dsub_);
+        std::vector<size_t> counts(ksub_);
+        for(size_t j = 0; j < m_; j++){
+            for(size_t i = 0; i < ns; i++)
+                memcpy(sub.data() + i * dsub_, data + sample[i] * dim_ + j * dsub_, dsub_ * sizeof(float));
+            float *cent = centroids_.data() + j * ksub_ * dsub_;
+            for(size_t c = 0; c < ksub_; c++)
+                memcpy(cent + c * dsub_, sub.data() + (c < ns ? c : rng() % ns) * dsub_, dsub_ * sizeof(float));
+
+            for(int it = 0; it < iters; it++){
+#pragma omp parallel for schedule(static)
+                for(size_t i = 0; i < ns; i++) assign[i] = nearest(cent, sub.data() + i * dsub_);
+
+                std::fill(sums.begin(), sums.end(), 0.0f);
+                std::fill(counts.begin(), counts.end(), 0);
+                for(size_t i = 0; i < ns; i++){
+                    counts[assign[i]]++;
+                    for(size_t d = 0; d < dsub_; d++) sums[assign[i] * dsub_ + d] += sub[i * dsub_ + d];
+                }
+                for(size_t c = 0; c < ksub_; c++){
+                    if(counts[c] == 0){
+                        // reseed an empty centroid with a random sample
+                        memcpy(cent + c * dsub_, sub.data() + (rng() % ns) * dsub_, dsub_ * sizeof(float));
+                        continue;
+                    }
+                    for(size_t d = 0; d < dsub_; d++) cent[c * dsub_ + d] = sums[c * dsub_ + d] / counts[c];
+                }
+            }
+        }
+    }
+
+    void encode(const float *vec, uint8_t *code) const {
+        memset(code, 0, codeSize());
+        for(size_t j = 0; j < m_; j++){
+            int c = nearest(centroids_.data() + j * ksub_ * dsub_, vec + j * dsub_);
+            if(nbits_ == 8) code[j] = c;
+            else code[j / 2] |= c << (4 * (j % 2));
+        }
+    }
+
+    void prepare(const float *query, QueryTable &qt) const {
+        qt.table.resize(m_ * ksub_);
+        for(size_t j = 0; j < m_; j++){
+            const float *q = query + j * dsub_;
+            const float *cent = centroids_.data() + j * ksub_ * dsub_;
+            for(size_t c = 0; c < ksub_; c++) qt.table[j * ksub_ + c] = l2(q, cent + c * dsub_);
+        }
+        if(nbits_ == 8) return;
+
+        // one scale for all subspaces, so that the byte entries can be summed directly
+        qt.lut.resize(m_ * ksub_);
+        qt.block.resize(codeSize() * 16);
+        qt.bias = 0;
+        float span = 0;
+        for(size_t j = 0; j < m_; j++){
+            const float *t = qt.table.data() + j * ksub_;
+            float lo = *std::min_element(t, t + ksub_), hi = *std::max_element(t, t + ksub_);
+            qt.bias += lo;
+            span = std::max(span, hi - lo);
+        }
+        qt.scale = span > 0 ? span / 255.0f : 1.0f;
+        for(size_t j = 0; j < m_; j++){
+            const float *t = qt.table.data() + j * ksub_;
+            float lo = *std::min_element(t, t + ksub_);
+            for(size_t c = 0; c < ksub_; c++)
+                qt.lut[j * ksub_ + c] = (uint8_t) std::min(255.0f, std::round((t[c] - lo) / qt.scale));
+        }
+    }
+
+    float distance(const QueryTable &qt, const uint8_t *code) const {
+        if(nbits_ == 8){
+            float res = 0;
+            for(size_t j = 0; j < m_; j++) res += qt.table[j * ksub_ + code[j]];
+            return res;
+        }
+        unsigned int sum = 0;
+        for(size_t j = 0; j < m_; j++) sum += qt.lut[j * ksub_ + ((code[j / 2] >> (4 * (j % 2))) & 15)];
+        return qt.bias + qt.scale * sum;
+    }
+
+    // out[i] = distance to the code of ids[i], codes holding codeSize() bytes per id
+    void distanceBatch(QueryTable &qt, const uint8_t *codes, const unsigned int *ids, size_t n, float *out) const {
+#if defined(__SSSE3__)
+        if(nbits_ == 4){
+            size_t cs = codeSize();
+            uint8_t *block = qt.block.data();
+            const __m128i mask = _mm_set1_epi8(0x0F);
+            const __m128i zero = _mm_setzero_si128();
+            for(size_t g = 0; g < n; g += 16){
+                size_t num = std::min<size_t>(16, n - g);
+                // transpose, byte b of the l-th code goes to block[b * 16 + l]
+                for(size_t l = 0; l < num; l++){
+                    const uint8_t *code = codes + (size_t) ids[g + l] * cs;
+                    for(size_t b = 0; b < cs; b++) block[b * 16 + l] = code[b];
+                }
+                for(size_t l = num; l < 16; l++)
+                    for(size_t b = 0; b < cs; b++) block[b * 16 + l] = 0;
+
+                __m128i accLo = _mm_setzero_si128(), accHi = _mm_setzero_si128();
+                for(size_t b = 0; b < cs; b++){
+                    __m128i v = _mm_loadu_si128((const __m128i *) (block + b * 16));
+                    __m128i lo = _mm_and_si128(v, mask);
+                    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+                    __m128i r0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (qt.lut.data() + 2 * b * 16)), lo);
+                    __m128i r1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (qt.lut.data() + (2 * b + 1) * 16)), hi);
+                    accLo = _mm_add_epi16(accLo, _mm_add_epi16(_mm_unpacklo_epi8(r0, zero), _mm_unpacklo_epi8(r1, zero)));
+                    accHi = _mm_add_epi16(accHi, _mm_add_epi16(_mm_unpackhi_epi8(r0, zero), _mm_unpackhi_epi8(r1, zero)));
+                }
+                alignas(16) uint16_t sums[16];
+                _mm_store_si128((__m128i *) sums, accLo);
+                _mm_store_si128((__m128i *) (sums + 8), accHi);
+                for(size_t l = 0; l < num; l++) out[g + l] = qt.bias + qt.scale * sums[l];
+            }
+            return;
+        }
+#endif
+        for(size_t i = 0; i < n; i++) out[i] = distance(qt, codes + (size_t) ids[i] * codeSize());
+    }
+
+    size_t dim() const { return dim_; }
+
+    size_t codeSize() const { return nbits_ == 8 ? m_ : m_ / 2; }
+
+    // m and nbits followed by the centroids
+    std::vector<char> serialize() const {
+        int header[2] = {(int) m_, nbits_};
+        std::vector<char> data(sizeof(header) + centroids_.size() * sizeof(float));
+        memcpy(data.data(), header, sizeof(header));
+        memcpy(data.data() + sizeof(header), centroids_.data(), centroids_.size() * sizeof(float));
+        return data;
+    }
+
+private:
+    size_t dim_, m_, dsub_, ksub_;
+    int nbits_;
+    std::vector<float> centroids_;    // m * ksub * dsub
+
+    void init(){
+        if(nbits_ != 4 && nbits_ != 8)
+            throw std::runtime_error("PQ supports 4 or 8 bits per code");
+        if(m_ == 0 || dim_ % m_ != 0)
+            throw std::runtime_error("PQ needs a dimension divisible by m");
+        // 4 bit codes are paired in bytes and summed in 16 bit lanes
+        if(nbits_ == 4 && (m_ % 2 != 0 || m_ > 256))
+            throw std::runtime_error("4 bit PQ needs an even m of at most 256");
+        dsub_ = dim_ / m_;
+        ksub_ = 1 << nbits_;
+        centroids_.assign(m_ * ksub_ * dsub_, 0);
+    }
+
+    float l2(const float *a, const float *b) const {
+        float res = 0;
+        for(size_t d = 0; d < dsub_; d++){
+            float t = a[d] - b[d];
+            res += t * t;
+        }
+        return res;
+    }
+
+    int nearest(const float *cent, const float *vec) const {
+        int best = 0;
+        float bestDist = std::numeric_limits<float>::max();
+        for(size_t c = 0; c < ksub_; c++){
+            float d = l2(vec, cent + c * dsub_);
+            if(d < bestDist){
+                bestDist = d;
+                best = c;
+            }
+        }
+        return best;
+    }
+};
+
+#endif //RANGEHNSW_QUANTIZER_HPP
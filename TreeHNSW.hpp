@@ -5,19 +5,59 @@
 #include <unordered_map>
 #include <algorithm>
 #include <random>
+#include <memory>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <omp.h>
 
 #include "hnswlib/hnswlib.h"
+#include "Quantizer.hpp"
+#include "DiskVectors.hpp"
 #define BTREE_M 3
 #define BTREE_D 2
 
+#define RANGEHNSW_INDEX_MAGIC 0x41524744   // "DGRA"
+#define RANGEHNSW_INDEX_VERSION 8
+#define RANGEHNSW_INDEX_SECTIONS 16
+#define RANGEHNSW_PAGE_SIZE 4096
+#define RANGEHNSW_FLAG_SORTED_IDS 1
+#define RANGEHNSW_FLAG_SQ8 2
+#define RANGEHNSW_FLAG_PQ 4
+#define RANGEHNSW_FLAG_INLINE_VALUES 8
+
+#define RANGEHNSW_LOG_MAGIC 0x4c524744   // "DGRL"
+#define RANGEHNSW_LOG_VERSION 1
+#define RANGEHNSW_LOG_INSERT 1
+#define RANGEHNSW_LOG_ERASE 2
+
+// visited set of a range search: renumbered id intervals up to this many ids use a bitset,
+// otherwise covering subtrees up to this many elements use a hash set, larger ones epoch tags
+#define RANGEHNSW_BITSET_VISITED_MAX (1 << 20)
+#define RANGEHNSW_HASH_VISITED_MAX 4096
+
 
 using namespace hnswlib;
 
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+
+// Distance of the index. InnerProduct ranks by 1 - <q, x>, Cosine normalizes the vectors
+// at insert and the query at search time and then ranks like InnerProduct.
+enum class Metric { L2, InnerProduct, Cosine };
 
 class RangeHNSW {
 public:
+    // degrees[l] limits the degree of the graphs at tree layer l, layers past its end use m.
+    // Lists are sized per layer, so low degrees on the small lower layers save link memory.
+    // Entries must not decrease, and must be at least 1 from layer 1 on.
     RangeHNSW(
             int d,
             size_t eleNum,
@@ -26,235 +66,1576 @@ public:
             int* keyList,
             int* valueList,
             int m,
-            int ef_con
+            int ef_con,
+            bool renumberIds = false,
+            Metric metric = Metric::L2,
+            const std::vector<int> &degrees = {}
     ):
-            M(m),ef_construction(ef_con), space(d), dim(d), linklist(maxEleNum), searchLayer(maxEleNum), eleCount(eleNum), maxNum(maxEleNum){
+            M(m),ef_construction(ef_con), metric_(metric), degreeSchedule_(degrees), dim(d), eleCount(eleNum), maxNum(maxEleNum){
 
         skipLayer = log(M)/log(BTREE_D);
         // M = M * 1.5;
         maxLayer = floor(log((float)maxEleNum) / log(BTREE_D));
+        initLayers();
 
-        visited_array = new unsigned int[maxEleNum];
+        visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, maxEleNum));
+        std::vector<std::mutex>(maxEleNum).swap(linkListLocks_);
 
         std::random_device rd;  // Obtain a random number from hardware
         eng = std::mt19937 (rd());
 
-        data_size_ = space.get_data_size();
-        fstdistfunc_ = space.get_dist_func();
-        dist_func_param_ = space.get_dist_func_param();
+        initSpace();
 
-        keyList_ = new int[maxEleNum];
-        valueList_ = new int[maxEleNum];
-        vecData_ = (char*)(new float[maxEleNum * dim]);
-        isDeleted = new bool[maxEleNum];
+        keyList_ = (int*) malloc(maxEleNum * sizeof(int));
+        valueList_ = (int*) malloc(maxEleNum * sizeof(int));
+        vecData_ = (char*) malloc(maxEleNum * dim * sizeof(float));
+        isDeleted = (bool*) malloc(maxEleNum * sizeof(bool));
         memset(isDeleted,0,maxEleNum);
         memcpy(keyList_,keyList, eleNum * sizeof(int));
         memcpy(valueList_,valueList, eleNum * sizeof(int));
         memcpy(vecData_,vecData, eleNum * dim * sizeof(float));
+        if(metric_ == Metric::Cosine){
+            for(size_t i = 0; i < eleNum; i++) normalizeVector((float *) getDataByInternalId(i));
+        }
 
 
         mult_ = 1 / log(1.0 * M);
         revSize_ = 1.0 / mult_;
 
-        sizeLinkList = (M * sizeof(tableint) + sizeof(linklistsizeint));
+        linkLayers_.assign(maxLayer + 1, nullptr);
+        for(int l = 0; l <= maxLayer; l++){
+            linkLayers_[l] = (char *) malloc(linkArenaSize(maxEleNum, l));
+            if (linkLayers_[l] == nullptr)
+                throw std::runtime_error("Not enough memory: RangeHNSW failed to allocate linklist");
+        }
 
-        space = hnswlib::L2Space(dim);
+        std::vector<int> sorted(eleNum);
+        for(int i = 0; i < eleNum; i++){
+            key2Id[keyList[i]] = i;
+            sorted[i] = i;
+        }
 
-        sortedArray.reserve(eleNum);
+        // after renumber the ids are in attribute order already
+        if(renumberIds) renumber();
+        else sort(sorted.begin(),sorted.end(),[this](int a, int b) { return this->cmp(a, b); });
 
+        root = buildTree(sorted);
 
-        for(int i = 0; i < eleNum; i++){
-            key2Id[keyList[i]] = i;
-            linklist[i] = (char *) malloc( (maxLayer + 1) * sizeLinkList);
-            sortedArray.push_back(i);
+    }
+
+    // Loads an index written by saveIndex. maxEleNum reserves room for further
+    // addPoint calls, 0 keeps the capacity the index was saved with.
+    // With mapped set the file is mapped read-only and vectors, attributes and link lists
+    // are used in place, and addPoint / erase / resize throw. The tree is not: it is rebuilt
+    // on the heap from its records, about two nodes of some 70 bytes per element, so opening
+    // still takes time and memory linear in the number of elements, though far less than
+    // the link lists and vectors would.
+    // With diskVectors set everything but the full vectors is loaded, the graph is traversed
+    // on the SQ8 or PQ codes and the candidates are re-ranked on vectors read from the file.
+    // Such an index is read-only as well.
+    RangeHNSW(const std::string &location, size_t maxEleNum = 0, bool mapped = false, bool diskVectors = false) {
+        loadIndex(location, maxEleNum, mapped, diskVectors);
+    }
+
+    ~RangeHNSW(){
+        // a failed flush cannot be reported from here, closeLog beforehand to see it
+        try { closeLog(); } catch (...) {}
+        if(mapped_){
+            munmap(mappedBase_, mappedSize_);
+            return;
         }
+        free(keyList_);
+        free(valueList_);
+        free(vecData_);
+        free(isDeleted);
+        free(codes_);
+        for(size_t l = 0; l < linkLayers_.size(); l++) free(linkLayers_[l]);
+    }
 
-        sort(sortedArray.begin(),sortedArray.end(),[this](int a, int b) { return this->cmp(a, b); });
+    // Can run alongside queries. Waits until the inserts in progress are linked, and holds
+    // back new ones and erasures until the file is written.
+    void saveIndex(const std::string &location) const {
+        std::unique_lock<std::shared_mutex> update = drainUpdates();
+        writeIndex(location);
+    }
 
-        root = buildTree(eleNum);
+    // candidate of the range search, remembers the layer its neighbors are expanded from
+    struct LayerCandidate{
+        float dist;
+        tableint id;
+        short int layer;
+
+        bool operator<(const LayerCandidate &other) const {
+            return dist < other.dist;
+        }
+    };
+
+    // Mutable per-query state. A context may be reused for any number of queries,
+    // but must not be used by two threads at the same time.
+    struct SearchContext{
+        std::unique_ptr<VisitedList> visited;
+        std::mt19937 eng;
+        // heaps of the running query, they keep their capacity so a warm context does not allocate
+        std::vector<std::pair<float, tableint>> results;    // farthest on top
+        std::vector<LayerCandidate> candidates;             // closest on top
+        std::vector<float> prepared;                        // query prepared for SQ8
+        std::vector<float> normalized;                      // query normalized for Cosine
+        PQQuantizer::QueryTable pqTable;                    // distance tables of the query for PQ
+        std::vector<tableint> batchIds;                     // neighbors scored together
+        std::vector<float> batchDists;
+        std::vector<char> batchInside;                      // whether batchIds[j] is in the range
+        std::vector<uint64_t> visitedBits;                  // storage of the visited sets
+        std::vector<tableint> visitedSlots;
+        std::vector<char> rows;                             // full vectors read from disk to re-rank
+        std::vector<tableint> scanIds;                      // points of an exact scan
+    };
 
+    std::unique_ptr<SearchContext> acquireSearchContext() const {
+        {
+            std::unique_lock<std::mutex> lock(contextGuard_);
+            if(!contextPool_.empty()){
+                std::unique_ptr<SearchContext> ctx = std::move(contextPool_.back());
+                contextPool_.pop_back();
+                return ctx;
+            }
+        }
+        std::unique_ptr<SearchContext> ctx(new SearchContext());
+        std::random_device rd;
+        ctx->eng = std::mt19937(rd());
+        return ctx;
     }
 
-    std::priority_queue<std::pair<float, hnswlib::labeltype>> queryRange(float *vecData, int rangeL, int rangeR, int k,int ef_s){
-        node* highNode = findHighNode(root,rangeL,rangeR);
+    void releaseSearchContext(std::unique_ptr<SearchContext> ctx) const {
+        std::unique_lock<std::mutex> lock(contextGuard_);
+        contextPool_.push_back(std::move(ctx));
+    }
 
-        int belongL = highNode->keynum;
-        int belongR = highNode->keynum;
-        for(int i = 0 ; i < highNode->keynum; i++){
-            if(rangeL < valueList_[highNode->key[i]] ||
-               (rangeL == valueList_[highNode->key[i]] && (rangeL == valueList_[findRight(highNode->child[i])]))){
-                belongL = i;
-                break;
+    std::priority_queue<std::pair<float, hnswlib::labeltype>> queryRange(float *vecData, int rangeL, int rangeR, int k,int ef_s) const {
+        std::unique_ptr<SearchContext> ctx = acquireSearchContext();
+        auto top = queryRange(*ctx, vecData, rangeL, rangeR, k, ef_s);
+        releaseSearchContext(std::move(ctx));
+        return top;
+    }
+
+    std::priority_queue<std::pair<float, hnswlib::labeltype>> queryRange(SearchContext &ctx, float *vecData, int rangeL, int rangeR, int k,int ef_s) const {
+        std::shared_lock<std::shared_mutex> latch = readLatch();
+        searchRange(ctx, vecData, rangeL, rangeR, ef_s);
+        std::vector<std::pair<float, tableint>> &result = ctx.results;
+
+        while(result.size() > k) popResult(result);
+
+        std::priority_queue<std::pair<float, hnswlib::labeltype>> top;
+        for(size_t i = 0; i < result.size(); i++) top.push({result[i].first, keyList_[result[i].second]});
+        return top;
+    }
+
+    // Writes the keys and distances (dists may be null) of the k nearest neighbors closest first
+    // into ids / dists, padded with -1 and the maximum float. Does not allocate once ctx is warm.
+    void queryRange(SearchContext &ctx, const float *vecData, int rangeL, int rangeR, int k, int ef_s,
+                    int *ids, float *dists) const {
+        std::shared_lock<std::shared_mutex> latch = readLatch();
+        searchRange(ctx, vecData, rangeL, rangeR, ef_s);
+        std::vector<std::pair<float, tableint>> &result = ctx.results;
+
+        while(result.size() > k) popResult(result);
+        std::sort_heap(result.begin(), result.end(), CompareByFirst());
+
+        for(int j = 0; j < k; j++){
+            if(j < result.size()){
+                ids[j] = keyList_[result[j].second];
+                if(dists) dists[j] = result[j].first;
+            }
+            else{
+                ids[j] = -1;
+                if(dists) dists[j] = std::numeric_limits<float>::max();
             }
         }
-        for(int i = 0 ; i < highNode->keynum; i++){
-            if(rangeR < valueList_[highNode->key[i]]){
-                belongR = i;
-                break;
+    }
+
+    // Answers n queries stored contiguously in queries (n * dim floats), query i is restricted
+    // to [ranges[i].first, ranges[i].second]. Row i of ids / dists (n * k each, dists may be null)
+    // receives the keys and distances of its k nearest neighbors closest first, padded with -1
+    // and the maximum float when fewer than k points are found.
+    // num_threads <= 0 uses the current OpenMP setting.
+    void queryRangeBatch(const float *queries, const std::pair<int,int> *ranges, size_t n, int k, int ef_s,
+                         int *ids, float *dists, int num_threads = 0) const {
+        if(num_threads <= 0) num_threads = omp_get_max_threads();
+
+#pragma omp parallel num_threads(num_threads)
+        {
+            std::unique_ptr<SearchContext> ctx = acquireSearchContext();
+#pragma omp for schedule(dynamic, 16)
+            for(size_t i = 0; i < n; i++){
+                queryRange(*ctx, queries + i * dim, ranges[i].first, ranges[i].second, k, ef_s,
+                           ids + i * k, dists == nullptr ? nullptr : dists + i * k);
             }
+            releaseSearchContext(std::move(ctx));
         }
-        std::vector<tableint > ep_ids;
-        std::priority_queue<std::pair<float, hnswlib::labeltype>> top;
-        if(belongL == belongR) {
-            top.push({0,keyList_[highNode->entryPoint]});
-            return top;
+    }
+
+    // May be called from several threads at once and alongside queries. The point is placed
+    // in the tree under the exclusive tree latch, which only holds queries back for that short
+    // step. The graphs are linked without it, queries do not wait for that. Throws when the index
+    // is full, or when the operation log cannot be flushed, in which case the point is added but
+    // may be lost.
+    void addPoint(int key,int value, char* data){
+        requireWritable();
+        // held until the point is linked, see updateLatch_
+        std::shared_lock<std::shared_mutex> update = updateLatch();
+        std::vector<node *> stale;
+        tableint id;
+        bool placed, sync;
+        {
+            std::unique_lock<std::shared_mutex> latch = writeLatch();
+            if(eleCount == maxNum)
+                throw std::runtime_error("The number of elements exceeds the specified limit");
+            sync = logOperation(RANGEHNSW_LOG_INSERT, key, value, (const float *) data);
+            id = eleCount;
+            keyList_[id] = key;
+            key2Id[key] = id;
+            valueList_[id] = value;
+            if(sortedIds_ && id > 0 && cmp(id, id - 1)) sortedIds_ = false;
+            float *stored = (float *) getDataByInternalId(id);
+            memcpy(stored, data, dim * sizeof(float));
+            if(metric_ == Metric::Cosine) normalizeVector(stored);
+            if(codes_) encode(stored, codes_ + id * codeSize());
+            for(int i = 0; i <= maxLayer; i++){
+                unsigned int *newListData = (unsigned int *) get_linklist(id, i);
+
+                commitList(newListData, 0, i);
+            }
+            eleCount ++;
+            placed = placePoint(id, stale);
         }
-        int sp;
-        if(belongL == belongR - 1){
-            node* nodeL = highNode->child[belongL];
-            while(nodeL->layer != 0 && valueList_[nodeL->key[nodeL->keynum - 1]] < rangeL) nodeL = nodeL->child[nodeL->keynum];
-            tableint ep1 = nodeL->layer != 0 ? findEntry(vecData,nodeL,nodeL->child[nodeL->keynum]->entryPoint) : nodeL->entryPoint;
-            ep_ids.push_back(ep1);
-            searchLayer[ep1] = nodeL->layer;
-            sp = highNode->key[belongL];
+        if(sync) syncLog();
+        if(!placed) return;
+        linkPoint(id, stale);
+    }
 
-            node* nodeR = highNode->child[belongR];
-            while(nodeR->layer != 0 && valueList_[nodeR->key[0]] > rangeR) nodeR = nodeR->child[0];
-            tableint ep2 = nodeR->layer != 0 ? findEntry(vecData,nodeR,nodeR->child[0]->entryPoint) : nodeR->entryPoint;
-            ep_ids.push_back(ep2);
-            searchLayer[ep2] = nodeR->layer;
+    // Number of live elements with value in [rangeL, rangeR], O(log n).
+    size_t countRange(int rangeL, int rangeR) const {
+        if(rangeL > rangeR) return 0;
+        std::shared_lock<std::shared_mutex> latch = readLatch();
+        return countBelow(rangeR, true) - countBelow(rangeL, false);
+    }
+
+    // Ranges holding at most max(minPoints, efFactor * ef) points are answered by an exact scan
+    // of their points instead of the graph search.
+    void setExactScanThreshold(size_t minPoints, float efFactor){
+        exactScanMin_ = minPoints;
+        exactScanFactor_ = efFactor;
+    }
+
+    // Sets the ef factor of the exact scan threshold from the measured cost of a full range
+    // graph search at ef against the cost of scanning one point, using n queries.
+    void calibrateExactScan(const float *queries, size_t n, int ef){
+        std::shared_lock<std::shared_mutex> latch = readLatch();
+        if(n == 0 || eleCount == 0) return;
+        std::unique_ptr<SearchContext> ctx = acquireSearchContext();
+        int rangeL = root->minValue, rangeR = root->maxValue;
+
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < n; i++){
+            ctx->results.clear();
+            searchGraph(*ctx, queries + i * dim, rangeL, rangeR, ef);
         }
-        else{
-            sp = -1;
-            std::uniform_int_distribution<> distr(belongL + 1, belongR -1);
-            tableint high_ep = highNode->child[distr(eng)]->entryPoint;
-            tableint ep = findEntry(vecData,highNode, high_ep);
-            ep_ids.push_back(ep);
-            searchLayer[ep] = highNode->layer;
+        double graphTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n;
+
+        size_t scanNum = std::min<size_t>(root->cnt, 1024);
+        start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < n; i++){
+            ctx->results.clear();
+            exactScan(*ctx, queries + i * dim, rangeL, rangeR, ef, scanNum);
         }
-        ResultHeap result = searchBaseLayer0(ep_ids,vecData,highNode->layer,rangeL,rangeR,ef_s,sp);
+        double pointTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n / scanNum;
+        releaseSearchContext(std::move(ctx));
 
-        while(result.size() > k) result.pop();
+        if(pointTime > 0) exactScanFactor_ = graphTime / pointTime / ef;
+    }
 
-        while(!result.empty()){
-            auto r = result.top();
-            result.pop();
-            top.push({r.first,keyList_[r.second]});
+    // Rebuilds the lists of whole nodes when they underflow, so it holds the exclusive latch
+    // throughout, after the inserts in progress are linked. Throws when no live point has the key.
+    void erase(int key){
+        requireWritable();
+        std::unique_lock<std::shared_mutex> update = drainUpdates();
+        bool sync;
+        {
+            std::unique_lock<std::shared_mutex> latch = writeLatch();
+            auto it = key2Id.find(key);
+            if(it == key2Id.end() || isDeleted[it->second])
+                throw std::runtime_error("Key not found");
+            sync = logOperation(RANGEHNSW_LOG_ERASE, key, 0, nullptr);
+            int id = it->second;
+            isDeleted[id] = true;
+            erase(root,id);
+            if(root->keynum == 0){
+                root->retired = true;
+                root = root->child[0];
+            }
         }
-        return top;
+        if(sync) syncLog();
     }
 
-    void addPoint(int key,int value, char* data){
-        keyList_[eleCount] = key;
-        key2Id[key] = eleCount;
-        valueList_[eleCount] = value;
-        memcpy(vecData_+ dim * sizeof(float) * eleCount, data, dim * sizeof(float));
-        linklist[eleCount] = (char *) malloc( (maxLayer + 1) * sizeLinkList);
-        for(int i = 0; i <= maxLayer; i++){
-            unsigned int *newListData = (unsigned int *) get_linklist(eleCount, i);
+    // Appends every following addPoint and erase to the operation log at location, creating it
+    // if needed. A torn record left by a crash is cut off first. The log is flushed to disk
+    // every syncEvery operations, 0 leaves flushing to the OS.
+    // Recovery: load the last checkpoint, replayLog the log, then openLog it again.
+    void openLog(const std::string &location, size_t syncEvery = 1){
+        requireWritable();
+        closeLog();
+        int fd = open(location.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file " + location);
+        try {
+            unsigned long long last = 0;
+            size_t valid = scanLog(fd, [&](const logRecord &r, const float *) { last = r.sequence; });
+            if (last > logSequence_)
+                throw std::runtime_error("Operation log holds operations missing from the index, replay it first");
+            if (valid == 0){
+                logFileHeader header{RANGEHNSW_LOG_MAGIC, RANGEHNSW_LOG_VERSION, (unsigned int) dim};
+                writeAll(fd, &header, sizeof(header));
+                valid = sizeof(header);
+            }
+            if (ftruncate(fd, valid) != 0 || lseek(fd, valid, SEEK_SET) < 0)
+                throw std::runtime_error("Cannot write file " + location);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        std::lock_guard<std::mutex> lock(logGuard_);
+        logFd_ = fd;
+        logLocation_ = location;
+        logSyncEvery_ = syncEvery;
+        logPending_ = 0;
+    }
+
+    // Flushes and closes the log, throws when the flush fails.
+    void closeLog(){
+        std::lock_guard<std::mutex> lock(logGuard_);
+        if(logFd_ < 0) return;
+        // an operation due for syncLog may not have been flushed yet
+        bool synced = logSyncEvery_ == 0 || fdatasync(logFd_) == 0;
+        bool closed = close(logFd_) == 0;
+        logFd_ = -1;
+        if(!synced || !closed)
+            throw std::runtime_error("Cannot write file " + logLocation_);
+    }
 
-            setListCount(newListData, 0);
+    // Applies the operations of the log at location that are newer than the index,
+    // returns how many. Stops at the first torn or corrupted record. Meant for recovery,
+    // before other threads use the index.
+    size_t replayLog(const std::string &location){
+        requireWritable();
+        int fd = open(location.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file " + location);
+        int logFd = logFd_;
+        logFd_ = -1;   // replayed operations are in the log already
+        size_t applied = 0;
+        try {
+            scanLog(fd, [&](const logRecord &r, const float *vec) {
+                if (r.sequence <= logSequence_) return;
+                if (r.op == RANGEHNSW_LOG_INSERT){
+                    if (eleCount == maxNum) resize(std::max<size_t>(2 * maxNum, 1024));
+                    addPoint(r.key, r.value, (char *) vec);
+                }
+                else erase(r.key);
+                logSequence_ = r.sequence;
+                applied++;
+            });
+        } catch (...) {
+            logFd_ = logFd;
+            close(fd);
+            throw;
         }
-        eleCount ++;
-        addPoint(eleCount - 1);
+        logFd_ = logFd;
+        close(fd);
+        return applied;
     }
 
-    void erase(int key){
-        int id = key2Id[key];
-        isDeleted[id] = true;
-        erase(root,id);
-        if(root->keynum == 0) root = root->child[0];
+    // Writes a snapshot to location and empties the open log. The snapshot records the last
+    // logged operation, so after a crash between the two steps replay skips what it holds.
+    // Inserts in progress are linked first, so that every logged point is in the snapshot with
+    // all its edges. New inserts and erasures wait until the log is emptied, queries go on.
+    void checkpoint(const std::string &location){
+        std::unique_lock<std::shared_mutex> update = drainUpdates();
+        std::string tmp = location + ".tmp";
+        writeIndex(tmp);
+        int fd = open(tmp.c_str(), O_RDONLY);
+        if (fd < 0 || fsync(fd) != 0){
+            if (fd >= 0) close(fd);
+            throw std::runtime_error("Cannot write file " + tmp);
+        }
+        close(fd);
+        if (rename(tmp.c_str(), location.c_str()) != 0)
+            throw std::runtime_error("Cannot write file " + location);
+        // the rename has to reach the disk before the log is emptied
+        size_t slash = location.find_last_of('/');
+        std::string dir = slash == std::string::npos ? "." : location.substr(0, slash + 1);
+        fd = open(dir.c_str(), O_RDONLY);
+        if (fd >= 0){
+            fsync(fd);
+            close(fd);
+        }
+        std::lock_guard<std::mutex> lock(logGuard_);
+        if (logFd_ >= 0){
+            if (ftruncate(logFd_, sizeof(logFileHeader)) != 0 || lseek(logFd_, 0, SEEK_END) < 0 ||
+                fdatasync(logFd_) != 0)
+                throw std::runtime_error("Cannot write file " + logLocation_);
+            logPending_ = 0;
+        }
     }
 
     void resize(size_t newMaxN){
+        requireWritable();
+        std::unique_lock<std::shared_mutex> update = drainUpdates();
+        std::unique_lock<std::shared_mutex> latch = writeLatch();
         int maxEleNum = newMaxN;
         skipLayer = log(M)/log(BTREE_D);
 
-        maxLayer = floor(log((float)maxEleNum) / log(BTREE_D));
+        maxLayer = std::max<int>(floor(log((float)maxEleNum) / log(BTREE_D)), linkLayers_.size() - 1);
 
-        visited_array = new unsigned int[maxEleNum];
+        visited_list_pool_.reset(new VisitedListPool(1, maxEleNum));
+        std::vector<std::mutex>(maxEleNum).swap(linkListLocks_);
+        {
+            std::unique_lock<std::mutex> lock(contextGuard_);
+            contextPool_.clear();
+        }
 
         std::random_device rd;  // Obtain a random number from hardware
         eng = std::mt19937 (rd());
 
-        data_size_ = space.get_data_size();
-        fstdistfunc_ = space.get_dist_func();
-        dist_func_param_ = space.get_dist_func_param();
-
         keyList_ = (int*) realloc(keyList_, maxEleNum * sizeof(int));
         valueList_ = (int*) realloc(valueList_, maxEleNum * sizeof(int));
         vecData_ = (char*)realloc(vecData_,maxEleNum * dim * sizeof(float ));
         isDeleted = (bool*) realloc(isDeleted, maxEleNum * sizeof(bool));
-        memset(isDeleted,0,maxEleNum);
+        memset(isDeleted + maxNum, 0, maxEleNum - maxNum);
+        if(codes_) codes_ = (uint8_t *) realloc(codes_, maxEleNum * codeSize());
 
 
         mult_ = 1 / log(1.0 * M);
         revSize_ = 1.0 / mult_;
 
-        sizeLinkList = (M * sizeof(tableint) + sizeof(linklistsizeint));
+        initLayers();
 
-        space = hnswlib::L2Space(dim);
-        linklist.resize(maxEleNum);
+        // one realloc per layer arena, layers added by the larger capacity start empty
+        linkLayers_.resize(maxLayer + 1, nullptr);
+        for(size_t l = 0; l < linkLayers_.size(); l++){
+            char *arena = (char *) realloc(linkLayers_[l], linkArenaSize(maxEleNum, l));
+            if (arena == nullptr)
+                throw std::runtime_error("Not enough memory: resize failed to allocate linklist");
+            linkLayers_[l] = arena;
+        }
+        maxNum = maxEleNum;
+    }
+
+    // Keeps an SQ8 code of every vector next to the float vectors. Queries then traverse the
+    // graph on the codes and re-rank their ef candidates on the float vectors.
+    void enableSQ8(){
+        requireWritable();
+        std::unique_lock<std::shared_mutex> update = drainUpdates();
+        std::unique_lock<std::shared_mutex> latch = writeLatch();
+        if(metric_ == Metric::InnerProduct)
+            throw std::runtime_error("SQ8 traversal needs the L2 or Cosine metric");
+        pq_.reset();
+        sq8_.reset(new SQ8Quantizer(dim));
+        sq8_->train((float *) vecData_, eleCount);
+        allocateCodes();
+        encodeAll();
+    }
 
-        for(int i = 0; i<maxEleNum;i++){
-            linklist[i] = (char *) realloc(linklist[i], (maxLayer + 1) * sizeLinkList);
+    // Same with product quantization: m sub-vectors of nbits (4 or 8) each, codebooks are
+    // trained on the current vectors. 4 bit codes are scored 16 neighbors at a time.
+    void enablePQ(size_t m, int nbits = 8){
+        requireWritable();
+        std::unique_lock<std::shared_mutex> update = drainUpdates();
+        std::unique_lock<std::shared_mutex> latch = writeLatch();
+        if(metric_ == Metric::InnerProduct)
+            throw std::runtime_error("PQ traversal needs the L2 or Cosine metric");
+        sq8_.reset();
+        pq_.reset(new PQQuantizer(dim, m, nbits));
+        pq_->train((float *) vecData_, eleCount);
+        allocateCodes();
+        encodeAll();
+    }
+
+    // Stores the attribute value of every neighbor next to its id in the link lists, so the
+    // range search rejects out of range neighbors without loading valueList_. Costs one int per
+    // neighbor slot. Not needed after renumber, where ids already give the order.
+    void enableInlineValues(){
+        requireWritable();
+        std::unique_lock<std::shared_mutex> update = drainUpdates();
+        std::unique_lock<std::shared_mutex> latch = writeLatch();
+        if(inlineValues_) return;
+        std::vector<size_t> oldSizes = sizeLinkList;
+        inlineValues_ = true;
+        initLayers();
+        std::vector<char *> arenas(linkLayers_.size(), nullptr);
+        for(size_t l = 0; l < arenas.size(); l++){
+            arenas[l] = (char *) malloc(linkArenaSize(maxNum, l));
+            if (arenas[l] == nullptr){
+                for(char *arena : arenas) free(arena);
+                inlineValues_ = false;
+                initLayers();
+                throw std::runtime_error("Not enough memory: enableInlineValues failed to allocate linklist");
+            }
         }
+        int topLayer = root ? root->layer : 0;
+        for(size_t l = 0; l < linkLayers_.size(); l++){
+            char *arena = arenas[l];
+            for(size_t i = 0; i < eleCount; i++){
+                linklistsizeint *list = (linklistsizeint *) (arena + i * sizeLinkList[l]);
+                memcpy(list, linkLayers_[l] + i * oldSizes[l], oldSizes[l]);
+                // layers above the root are never written
+                if(l >= 1 && (int) l <= topLayer) commitList(list, getListCount(list), l);
+            }
+            free(linkLayers_[l]);
+            linkLayers_[l] = arena;
+        }
+    }
 
-        for(int i = maxNum; i < maxEleNum; i++){
-            linklist[i] = (char *) malloc( (maxLayer + 1) * sizeLinkList);
+    // Renumbers internal ids so that id i is the i-th element in attribute order. Every subtree
+    // then covers a contiguous id interval and the search checks ranges by comparing ids.
+    // Holds until a point is added with a smaller value than the last one.
+    void renumber(){
+        requireWritable();
+        std::unique_lock<std::shared_mutex> update = drainUpdates();
+        std::unique_lock<std::shared_mutex> latch = writeLatch();
+
+        std::vector<int> order(eleCount);
+        for(size_t i = 0; i < eleCount; i++) order[i] = i;
+        sort(order.begin(),order.end(),[this](int a, int b) { return this->cmp(a, b); });
+        std::vector<tableint> newId(eleCount);
+        for(size_t i = 0; i < eleCount; i++) newId[order[i]] = i;
+
+        permuteArray(keyList_, order);
+        permuteArray(valueList_, order);
+        permuteArray(isDeleted, order);
+        char *vecData = (char *) malloc(maxNum * data_size_);
+        if (vecData == nullptr)
+            throw std::runtime_error("Not enough memory: renumber failed to allocate data");
+        for(size_t i = 0; i < eleCount; i++)
+            memcpy(vecData + i * data_size_, getDataByInternalId(order[i]), data_size_);
+        free(vecData_);
+        vecData_ = vecData;
+        if(codes_) encodeAll();
+
+        // before buildTree the lists and the tree hold nothing yet
+        if(root != nullptr){
+            for(size_t l = 0; l < linkLayers_.size(); l++){
+                char *arena = (char *) malloc(linkArenaSize(maxNum, l));
+                if (arena == nullptr)
+                    throw std::runtime_error("Not enough memory: renumber failed to allocate linklist");
+                for(size_t i = 0; i < eleCount; i++){
+                    linklistsizeint *list = (linklistsizeint *) (arena + i * sizeLinkList[l]);
+                    memcpy(list, get_linklist(order[i], l), sizeLinkList[l]);
+                    if(l == 0 || l > root->layer) continue;   // never written
+                    tableint *ids = (tableint *) (list + 1);
+                    int size = getListCount(list);
+                    for(int j = 0; j < size; j++) ids[j] = newId[ids[j]];
+                }
+                free(linkLayers_[l]);
+                linkLayers_[l] = arena;
+            }
+            renumberNode(root, newId);
         }
+
+        key2Id.clear();
+        for(size_t i = 0; i < eleCount; i++) key2Id[keyList_[i]] = i;
+        sortedIds_ = true;
     }
 
 private:
 
     size_t maxNum, eleCount;
-    size_t sizeLinkList;
+    std::vector<int> degreeSchedule_;   // requested degree per tree layer, missing layers use M
+    std::vector<size_t> maxM_;          // degree of the lists at each layer
+    std::vector<size_t> sizeLinkList;   // bytes of a list at each layer
     struct node{
         int entryPoint = -1;
         int keynum = 0;
+        int cnt = 0;    // number of elements in the subtree
+        int minValue, maxValue;    // value range of the subtree
         int key[BTREE_M];
         struct node* child[BTREE_M + 1];
         short int layer; //layer in tree
+        bool retired = false;   // merged away or dropped as root, a pending refresh skips it
 
         node(){}
 
     };
 
+    std::deque<node> nodePool_;   // owns every tree node, addresses stay stable
+
+    node* newNode(){
+        nodePool_.emplace_back();
+        return &nodePool_.back();
+    }
+
+    // On-disk layout: a header page followed by page aligned sections, so that a mapped
+    // index can use vectors, attributes and link lists in place.
+    enum indexSection{ SEC_KEYS, SEC_VALUES, SEC_DELETED, SEC_VECTORS, SEC_LINKS, SEC_TREE,
+                       SEC_QUANTIZER, SEC_CODES, SEC_DEGREES, SEC_NUM };
+
+    struct indexHeader{
+        unsigned int magic, version, flags;
+        int dim, M, ef_construction, maxLayer, metric;
+        size_t maxNum, eleCount, nodeNum;
+        long long numEdges;
+        unsigned long long logSequence;   // last logged operation the index contains
+        size_t sectionOffset[RANGEHNSW_INDEX_SECTIONS];
+        size_t sectionSize[RANGEHNSW_INDEX_SECTIONS];
+    };
+    static_assert(sizeof(indexHeader) <= RANGEHNSW_PAGE_SIZE, "index header must fit in its page");
+
+    // tree node with children stored as record indices, records are in preorder
+    struct treeRecord{
+        int entryPoint;
+        int keynum;
+        int key[BTREE_M];
+        int child[BTREE_M + 1];
+        int layer;
+    };
+
+    std::unique_ptr<DiskVectorStore> diskVectors_;   // full vectors when they stay in the file
+
+    void requireWritable() const {
+        if(mapped_) throw std::runtime_error("Index is mapped read-only");
+        if(diskVectors_) throw std::runtime_error("Index keeps its vectors on disk and is read-only");
+    }
+
+    void writeIndex(const std::string &location) const {
+        std::ofstream output(location, std::ios::binary);
+        if (!output.is_open())
+            throw std::runtime_error("Cannot open file " + location);
+
+        std::vector<treeRecord> records;
+        flattenNode(root, records);
+
+        indexHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = RANGEHNSW_INDEX_MAGIC;
+        header.version = RANGEHNSW_INDEX_VERSION;
+        header.dim = dim;
+        header.metric = (int) metric_;
+        header.M = M;
+        header.ef_construction = ef_construction;
+        header.maxLayer = maxLayer;
+        header.maxNum = maxNum;
+        header.eleCount = eleCount;
+        header.nodeNum = records.size();
+        header.numEdges = numEdges;
+        header.logSequence = logSequence_;
+        header.flags = sortedIds_ ? RANGEHNSW_FLAG_SORTED_IDS : 0;
+        if(sq8_) header.flags |= RANGEHNSW_FLAG_SQ8;
+        if(pq_) header.flags |= RANGEHNSW_FLAG_PQ;
+        if(inlineValues_) header.flags |= RANGEHNSW_FLAG_INLINE_VALUES;
+
+        std::vector<char> quantizerParams;
+        if(sq8_) quantizerParams = sq8_->serialize();
+        if(pq_) quantizerParams = pq_->serialize();
+        const char *sections[SEC_NUM] = {(char *) keyList_, (char *) valueList_, (char *) isDeleted, vecData_,
+                                         nullptr, (char *) records.data(),
+                                         (char *) quantizerParams.data(), (char *) codes_,
+                                         (char *) degreeSchedule_.data()};
+        header.sectionSize[SEC_KEYS] = eleCount * sizeof(int);
+        header.sectionSize[SEC_VALUES] = eleCount * sizeof(int);
+        header.sectionSize[SEC_DELETED] = eleCount * sizeof(bool);
+        header.sectionSize[SEC_VECTORS] = eleCount * data_size_;
+        header.sectionSize[SEC_LINKS] = linkSectionSize(maxLayer);
+        header.sectionSize[SEC_TREE] = records.size() * sizeof(treeRecord);
+        header.sectionSize[SEC_QUANTIZER] = quantizerParams.size();
+        header.sectionSize[SEC_CODES] = eleCount * codeSize();
+        header.sectionSize[SEC_DEGREES] = degreeSchedule_.size() * sizeof(int);
+
+        size_t offset = RANGEHNSW_PAGE_SIZE;
+        for(int s = 0; s < SEC_NUM; s++){
+            header.sectionOffset[s] = offset;
+            offset = alignPage(offset + header.sectionSize[s]);
+        }
+
+        output.write((char *) &header, sizeof(header));
+        for(int s = 0; s < SEC_NUM; s++){
+            padTo(output, header.sectionOffset[s]);
+            if(s == SEC_LINKS){
+                for(int l = 0; l <= maxLayer; l++) output.write(linkLayers_[l], eleCount * sizeLinkList[l]);
+            }
+            else if(s == SEC_VECTORS && diskVectors_) writeDiskVectors(output);
+            else output.write(sections[s], header.sectionSize[s]);
+        }
+        padTo(output, offset);
+        output.close();
+    }
+
+    void writeDiskVectors(std::ostream &output) const {
+        std::vector<tableint> ids(1024);
+        std::vector<char> rows(ids.size() * data_size_);
+        for(size_t i = 0; i < eleCount; i += ids.size()){
+            size_t n = std::min(ids.size(), eleCount - i);
+            for(size_t j = 0; j < n; j++) ids[j] = i + j;
+            diskVectors_->fetch(ids.data(), n, rows.data());
+            output.write(rows.data(), n * data_size_);
+        }
+    }
+
+    char *mappedBase_{nullptr};
+    size_t mappedSize_{0};
+    bool mapped_{false};
+
+    static size_t alignPage(size_t offset){
+        return (offset + RANGEHNSW_PAGE_SIZE - 1) / RANGEHNSW_PAGE_SIZE * RANGEHNSW_PAGE_SIZE;
+    }
+
+    static void padTo(std::ostream &output, size_t offset){
+        static const char zeros[RANGEHNSW_PAGE_SIZE] = {};
+        size_t pos = output.tellp();
+        if(offset > pos) output.write(zeros, offset - pos);
+    }
+
+    void flattenNode(node *nd, std::vector<treeRecord> &records) const {
+        size_t pos = records.size();
+        records.emplace_back();
+        treeRecord r;
+        memset(&r, 0, sizeof(r));
+        r.entryPoint = nd->entryPoint;
+        r.keynum = nd->keynum;
+        memcpy(r.key, nd->key, sizeof(r.key));
+        r.layer = nd->layer;
+        if(nd->layer != 0){
+            for(int i = 0; i <= nd->keynum; i++){
+                r.child[i] = records.size();
+                flattenNode(nd->child[i], records);
+            }
+        }
+        records[pos] = r;
+    }
+
+    // one heap node per record, also for a mapped index: the search follows node pointers
+    // and uses the subtree summaries, which the records do not hold
+    node* readTree(const treeRecord *records, size_t nodeNum){
+        if(nodeNum == 0)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        std::vector<node*> nodes(nodeNum);
+        for(size_t i = 0; i < nodeNum; i++) nodes[i] = newNode();
+        for(size_t i = 0; i < nodeNum; i++){
+            const treeRecord &r = records[i];
+            node *nd = nodes[i];
+            if(r.keynum < 0 || r.keynum >= BTREE_M || r.layer < 0)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            nd->entryPoint = r.entryPoint;
+            nd->keynum = r.keynum;
+            memcpy(nd->key, r.key, sizeof(nd->key));
+            nd->layer = r.layer;
+            if(nd->layer == 0) continue;
+            for(int j = 0; j <= nd->keynum; j++){
+                // preorder, so a child always comes after its parent
+                if(r.child[j] <= (int) i || r.child[j] >= (int) nodeNum)
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                nd->child[j] = nodes[r.child[j]];
+            }
+        }
+        // children come after their parent, so a reverse pass sees every child first
+        for(size_t i = nodeNum; i-- > 0; ) updateSummary(nodes[i]);
+        return nodes[0];
+    }
+
+    void loadIndex(const std::string &location, size_t maxEleNum, bool mapped, bool diskVectors) {
+        if(mapped && diskVectors)
+            throw std::runtime_error("An index is either mapped or keeps its vectors on disk");
+        int fd = open(location.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file " + location);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(indexHeader)) {
+            close(fd);
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+        size_t fileSize = st.st_size;
+        char *base = (char *) mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+            throw std::runtime_error("Cannot map file " + location);
+
+        try {
+            readIndex(base, fileSize, maxEleNum, mapped, diskVectors);
+            if(diskVectors){
+                const indexHeader &header = *(const indexHeader *) base;
+                diskVectors_.reset(new DiskVectorStore(location, header.sectionOffset[SEC_VECTORS], data_size_));
+            }
+        } catch (...) {
+            munmap(base, fileSize);
+            throw;
+        }
+
+        if(mapped){
+            mappedBase_ = base;
+            mappedSize_ = fileSize;
+            mapped_ = true;
+        }
+        else munmap(base, fileSize);
+    }
+
+    void readIndex(char *base, size_t fileSize, size_t maxEleNum, bool mapped, bool diskVectors) {
+        const indexHeader &header = *(const indexHeader *) base;
+        if(header.magic != RANGEHNSW_INDEX_MAGIC || header.version != RANGEHNSW_INDEX_VERSION)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        for(int s = 0; s < SEC_NUM; s++){
+            if(header.sectionOffset[s] % RANGEHNSW_PAGE_SIZE != 0 || header.sectionOffset[s] > fileSize ||
+               header.sectionSize[s] > fileSize - header.sectionOffset[s])
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+
+        dim = header.dim;
+        if(header.metric < (int) Metric::L2 || header.metric > (int) Metric::Cosine)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        metric_ = (Metric) header.metric;
+        M = header.M;
+        ef_construction = header.ef_construction;
+        eleCount = header.eleCount;
+        numEdges = header.numEdges;
+        logSequence_ = header.logSequence;
+        sortedIds_ = header.flags & RANGEHNSW_FLAG_SORTED_IDS;
+        inlineValues_ = header.flags & RANGEHNSW_FLAG_INLINE_VALUES;
+        const int *degrees = (const int *) (base + header.sectionOffset[SEC_DEGREES]);
+        degreeSchedule_.assign(degrees, degrees + header.sectionSize[SEC_DEGREES] / sizeof(int));
+        const char *quantizerParams = base + header.sectionOffset[SEC_QUANTIZER];
+        if(header.flags & RANGEHNSW_FLAG_SQ8)
+            sq8_.reset(new SQ8Quantizer(header.dim, quantizerParams, header.sectionSize[SEC_QUANTIZER]));
+        if(header.flags & RANGEHNSW_FLAG_PQ)
+            pq_.reset(new PQQuantizer(header.dim, quantizerParams, header.sectionSize[SEC_QUANTIZER]));
+        if(header.sectionSize[SEC_CODES] != header.eleCount * codeSize())
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        if(diskVectors && !codeSize())
+            throw std::runtime_error("Vectors on disk need SQ8 or PQ codes for the traversal");
+
+        if(mapped || diskVectors){
+            maxNum = eleCount;
+            maxLayer = header.maxLayer;
+        }
+        else {
+            maxNum = maxEleNum < eleCount ? header.maxNum : maxEleNum;
+            maxLayer = std::max<int>(floor(log((float)maxNum) / log(BTREE_D)), header.maxLayer);
+        }
+        skipLayer = log(M)/log(BTREE_D);
+        mult_ = 1 / log(1.0 * M);
+        revSize_ = 1.0 / mult_;
+        if(header.maxLayer < 0)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        initLayers();
+
+        initSpace();
+
+        if(header.sectionSize[SEC_DEGREES] % sizeof(int) != 0 ||
+           header.sectionSize[SEC_KEYS] != eleCount * sizeof(int) ||
+           header.sectionSize[SEC_VALUES] != eleCount * sizeof(int) ||
+           header.sectionSize[SEC_DELETED] != eleCount * sizeof(bool) ||
+           header.sectionSize[SEC_VECTORS] != eleCount * data_size_ ||
+           header.sectionSize[SEC_LINKS] != linkSectionSize(header.maxLayer) ||
+           header.sectionSize[SEC_TREE] != header.nodeNum * sizeof(treeRecord))
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        // only inserts and erasures use the insert-time visited lists and the element locks
+        if(!mapped && !diskVectors){
+            visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, maxNum));
+            std::vector<std::mutex>(maxNum).swap(linkListLocks_);
+        }
+        std::random_device rd;
+        eng = std::mt19937 (rd());
+
+        char *links = base + header.sectionOffset[SEC_LINKS];
+        if(mapped){
+            keyList_ = (int *) (base + header.sectionOffset[SEC_KEYS]);
+            valueList_ = (int *) (base + header.sectionOffset[SEC_VALUES]);
+            isDeleted = (bool *) (base + header.sectionOffset[SEC_DELETED]);
+            vecData_ = base + header.sectionOffset[SEC_VECTORS];
+            if(codeSize()) codes_ = (uint8_t *) (base + header.sectionOffset[SEC_CODES]);
+            linkLayers_.resize(maxLayer + 1);
+            for(int l = 0; l <= maxLayer; l++){
+                linkLayers_[l] = links;
+                links += eleCount * sizeLinkList[l];
+            }
+        }
+        else {
+            keyList_ = (int*) malloc(maxNum * sizeof(int));
+            valueList_ = (int*) malloc(maxNum * sizeof(int));
+            vecData_ = diskVectors ? nullptr : (char*) malloc(maxNum * data_size_);
+            isDeleted = (bool*) malloc(maxNum * sizeof(bool));
+            if (keyList_ == nullptr || valueList_ == nullptr || (vecData_ == nullptr && !diskVectors) ||
+                isDeleted == nullptr)
+                throw std::runtime_error("Not enough memory: loadIndex failed to allocate data");
+            memset(isDeleted, 0, maxNum);
+
+            memcpy(keyList_, base + header.sectionOffset[SEC_KEYS], header.sectionSize[SEC_KEYS]);
+            memcpy(valueList_, base + header.sectionOffset[SEC_VALUES], header.sectionSize[SEC_VALUES]);
+            memcpy(isDeleted, base + header.sectionOffset[SEC_DELETED], header.sectionSize[SEC_DELETED]);
+            if(!diskVectors) memcpy(vecData_, base + header.sectionOffset[SEC_VECTORS], header.sectionSize[SEC_VECTORS]);
+            if(codeSize()){
+                allocateCodes();
+                memcpy(codes_, base + header.sectionOffset[SEC_CODES], header.sectionSize[SEC_CODES]);
+            }
+
+            linkLayers_.assign(maxLayer + 1, nullptr);
+            for(int l = 0; l <= maxLayer; l++){
+                linkLayers_[l] = (char *) malloc(linkArenaSize(maxNum, l));
+                if (linkLayers_[l] == nullptr)
+                    throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
+                if(l <= header.maxLayer){
+                    memcpy(linkLayers_[l], links, eleCount * sizeLinkList[l]);
+                    links += eleCount * sizeLinkList[l];
+                }
+            }
+
+            for(size_t i = 0; i < eleCount; i++) key2Id[keyList_[i]] = i;
+        }
+
+        root = readTree((const treeRecord *) (base + header.sectionOffset[SEC_TREE]), header.nodeNum);
+    }
+
+    // bytes per element of the active quantizer, 0 without one
+    size_t codeSize() const {
+        if(sq8_) return sq8_->codeSize();
+        if(pq_) return pq_->codeSize();
+        return 0;
+    }
+
+    void encode(const float *vec, uint8_t *code) const {
+        if(sq8_) sq8_->encode(vec, code);
+        else pq_->encode(vec, code);
+    }
+
+    void allocateCodes(){
+        free(codes_);
+        codes_ = (uint8_t *) malloc(maxNum * codeSize());
+        if (codes_ == nullptr)
+            throw std::runtime_error("Not enough memory: failed to allocate codes");
+    }
+
+    void encodeAll(){
+        for(size_t i = 0; i < eleCount; i++)
+            encode((float *) getDataByInternalId(i), codes_ + i * codeSize());
+    }
+
+    template<typename T>
+    void permuteArray(T *array, const std::vector<int> &order){
+        std::vector<T> tmp(order.size());
+        for(size_t i = 0; i < order.size(); i++) tmp[i] = array[order[i]];
+        std::copy(tmp.begin(), tmp.end(), array);
+    }
+
+    void renumberNode(node *nd, const std::vector<tableint> &newId){
+        if(nd->entryPoint >= 0) nd->entryPoint = newId[nd->entryPoint];
+        if(nd->layer == 0) return;
+        for(int i = 0; i < nd->keynum; i++) nd->key[i] = newId[nd->key[i]];
+        for(int i = 0; i <= nd->keynum; i++) renumberNode(nd->child[i], newId);
+    }
+
+    // distance from the query to an element, location is what the traversal prefetches and
+    // batch scores the gathered neighbors of a candidate at once
+    struct ExactDistance{
+        const RangeHNSW *index;
+        const void *query;
+
+        float operator()(tableint id) const {
+            return index->fstdistfunc_(query, index->getDataByInternalId(id), index->dist_func_param_);
+        }
+
+        const char *location(tableint id) const {
+            return index->getDataByInternalId(id);
+        }
+
+        // one call of the space's batched kernel per 64 rows when it has one
+        void batch(const tableint *ids, size_t n, float *out) const {
+            if(index->fstdistfunc_batch_ == nullptr){
+                for(size_t i = 0; i < n; i++) out[i] = (*this)(ids[i]);
+                return;
+            }
+            const void *rows[64];
+            for(size_t i = 0; i < n; i += 64){
+                size_t num = std::min<size_t>(64, n - i);
+                for(size_t j = 0; j < num; j++) rows[j] = index->getDataByInternalId(ids[i + j]);
+                index->fstdistfunc_batch_(query, rows, num, index->dist_func_param_, out + i);
+            }
+        }
+    };
+
+    struct SQ8Distance{
+        const SQ8Quantizer *quantizer;
+        const float *prepared;
+        const uint8_t *codes;
+
+        float operator()(tableint id) const {
+            return quantizer->distance(prepared, codes + (size_t) id * quantizer->codeSize());
+        }
+
+        const char *location(tableint id) const {
+            return (const char *) codes + (size_t) id * quantizer->codeSize();
+        }
+
+        void batch(const tableint *ids, size_t n, float *out) const {
+            for(size_t i = 0; i < n; i++) out[i] = (*this)(ids[i]);
+        }
+    };
+
+    struct PQDistance{
+        const PQQuantizer *quantizer;
+        PQQuantizer::QueryTable *table;
+        const uint8_t *codes;
+
+        float operator()(tableint id) const {
+            return quantizer->distance(*table, codes + (size_t) id * quantizer->codeSize());
+        }
+
+        const char *location(tableint id) const {
+            return (const char *) codes + (size_t) id * quantizer->codeSize();
+        }
+
+        void batch(const tableint *ids, size_t n, float *out) const {
+            quantizer->distanceBatch(*table, codes, ids, n, out);
+        }
+    };
+
+    // range membership tests used by searchBaseLayer0, entry(datal, j) tests the j-th
+    // neighbor of a link list and mask(datal, j, ids, active) the 8 from the j-th on.
+    // Both read the lists of the layer given to forLayer. confirm(id) is asked before
+    // a neighbor that passed them becomes a result.
+    struct ValueRangeFilter{
+        const int *values;
+        int rangeL, rangeR;
+
+        bool operator()(tableint id) const {
+            return values[id] >= rangeL && values[id] <= rangeR;
+        }
+
+        const ValueRangeFilter &forLayer(int layer) const {
+            return *this;
+        }
+
+        bool entry(const tableint *datal, size_t j) const {
+            return (*this)(datal[j]);
+        }
+
+        bool confirm(tableint id) const {
+            return true;
+        }
+
+#if defined(USE_AVX2)
+        HNSWLIB_TARGET_AVX2 __m256i mask(const tableint *datal, size_t j, __m256i ids, __m256i active) const {
+            __m256i v = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), values, ids, active, 4);
+            __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(rangeL), v),
+                                          _mm256_cmpgt_epi32(v, _mm256_set1_epi32(rangeR)));
+            return _mm256_andnot_si256(out, active);
+        }
+#endif
+    };
+
+    // ids in [lo, lo + num), only valid when sortedIds_ is set
+    struct IdRangeFilter{
+        tableint lo, num;
+
+        bool operator()(tableint id) const {
+            return id - lo < num;
+        }
+
+        const IdRangeFilter &forLayer(int layer) const {
+            return *this;
+        }
+
+        bool entry(const tableint *datal, size_t j) const {
+            return (*this)(datal[j]);
+        }
+
+        bool confirm(tableint id) const {
+            return true;
+        }
+
+#if defined(USE_AVX2)
+        HNSWLIB_TARGET_AVX2 __m256i mask(const tableint *datal, size_t j, __m256i ids, __m256i active) const {
+            // unsigned id - lo <= num - 1, num is never 0 here
+            __m256i d = _mm256_sub_epi32(ids, _mm256_set1_epi32(lo));
+            return _mm256_cmpeq_epi32(_mm256_min_epu32(d, _mm256_set1_epi32(num - 1)), d);
+        }
+#endif
+    };
+
+    // reads neighbor values from the link list itself, only valid when inlineValues_ is set
+    struct InlineValueFilter{
+        const int *values;
+        int rangeL, rangeR;
+        const size_t *layerMaxM;    // maxM_, the values of a list follow its maxM ids
+        size_t maxM;
+
+        bool operator()(tableint id) const {
+            return values[id] >= rangeL && values[id] <= rangeR;
+        }
+
+        InlineValueFilter forLayer(int layer) const {
+            InlineValueFilter filter = *this;
+            filter.maxM = layerMaxM[layer];
+            return filter;
+        }
+
+        bool entry(const tableint *datal, size_t j) const {
+            int value = ((const int *) (datal + maxM))[j];
+            return value >= rangeL && value <= rangeR;
+        }
+
+        // a list being rewritten by an insert may pair a new id with the old value,
+        // so results are checked again against values[id]
+        bool confirm(tableint id) const {
+            return (*this)(id);
+        }
+
+#if defined(USE_AVX2)
+        HNSWLIB_TARGET_AVX2 __m256i mask(const tableint *datal, size_t j, __m256i ids, __m256i active) const {
+            __m256i v = _mm256_maskload_epi32((const int *) (datal + maxM) + j, active);
+            __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(rangeL), v),
+                                          _mm256_cmpgt_epi32(v, _mm256_set1_epi32(rangeR)));
+            return _mm256_andnot_si256(out, active);
+        }
+#endif
+    };
+
+    // Visited sets of searchBaseLayer0. testAndSet marks an id and tells whether it was marked
+    // before, seen is a vector hint for 8 ids that may leave some of them to testAndSet.
+
+    // 16 bit epoch tags over all ids, reset by bumping the epoch
+    struct EpochVisited{
+        vl_type *tags;
+        vl_type tag;
+
+        bool testAndSet(tableint id){
+            if(tags[id] == tag) return true;
+            tags[id] = tag;
+            return false;
+        }
+
+        void prefetch(tableint id) const {
+#ifdef USE_SSE
+            _mm_prefetch((char *) (tags + id), _MM_HINT_T0);
+#endif
+        }
+
+#if defined(USE_AVX2)
+        HNSWLIB_TARGET_AVX2 __m256i seen(__m256i ids, __m256i active) const {
+            // the list has a spare tag, so the 32 bit load of the last one stays inside
+            __m256i t = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *) tags, ids, active,
+                                                    sizeof(vl_type));
+            return _mm256_cmpeq_epi32(_mm256_and_si256(t, _mm256_set1_epi32(0xFFFF)), _mm256_set1_epi32(tag));
+        }
+#endif
+    };
+
+    // one bit per id of [base, base + num), cleared per query. Ids outside count as visited,
+    // the search never leaves the subtree of the covering node.
+    struct BitsetVisited{
+        uint64_t *bits;
+        tableint base, num;
+
+        bool testAndSet(tableint id){
+            tableint offset = id - base;
+            if(offset >= num) return true;
+            uint64_t bit = 1ULL << (offset & 63);
+            if(bits[offset >> 6] & bit) return true;
+            bits[offset >> 6] |= bit;
+            return false;
+        }
+
+        void prefetch(tableint id) const {}
+
+#if defined(USE_AVX2)
+        HNSWLIB_TARGET_AVX2 __m256i seen(__m256i ids, __m256i active) const {
+            __m256i offset = _mm256_sub_epi32(ids, _mm256_set1_epi32(base));
+            __m256i inside = _mm256_cmpeq_epi32(_mm256_min_epu32(offset, _mm256_set1_epi32(num - 1)), offset);
+            __m256i words = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *) bits,
+                                                        _mm256_srli_epi32(offset, 5),
+                                                        _mm256_and_si256(inside, active), 4);
+            __m256i bit = _mm256_srlv_epi32(words, _mm256_and_si256(offset, _mm256_set1_epi32(31)));
+            __m256i marked = _mm256_cmpeq_epi32(_mm256_and_si256(bit, _mm256_set1_epi32(1)), _mm256_set1_epi32(1));
+            return _mm256_or_si256(marked, _mm256_andnot_si256(inside, active));
+        }
+#endif
+    };
+
+    // open addressing set for searches in small subtrees, grows past half load
+    struct HashVisited{
+        std::vector<tableint> &slots;
+        size_t used;
+
+        static constexpr tableint empty = (tableint) -1;
+
+        bool testAndSet(tableint id){
+            size_t mask = slots.size() - 1;
+            for(size_t h = hash(id) & mask; ; h = (h + 1) & mask){
+                if(slots[h] == id) return true;
+                if(slots[h] == empty){
+                    slots[h] = id;
+                    if(++used * 2 > slots.size()) grow();
+                    return false;
+                }
+            }
+        }
+
+        void prefetch(tableint id) const {}
+
+#if defined(USE_AVX2)
+        HNSWLIB_TARGET_AVX2 __m256i seen(__m256i ids, __m256i active) const {
+            return _mm256_setzero_si256();
+        }
+#endif
+
+        static size_t hash(tableint id){
+            return (id * 0x9E3779B97F4A7C15ULL) >> 32;
+        }
+
+        void grow(){
+            std::vector<tableint> old(slots.size() * 2, empty);
+            old.swap(slots);
+            used = 0;
+            for(tableint id : old)
+                if(id != empty) testAndSet(id);
+        }
+    };
+
+    EpochVisited epochVisited(SearchContext &ctx) const {
+        if(!ctx.visited || ctx.visited->numelements < maxNum) ctx.visited.reset(new VisitedList(maxNum));
+        ctx.visited->reset();
+        return EpochVisited{ctx.visited->mass, ctx.visited->curV};
+    }
+
+    BitsetVisited bitsetVisited(SearchContext &ctx, size_t base, size_t num) const {
+        ctx.visitedBits.assign((num + 63) / 64 + 1, 0);
+        return BitsetVisited{ctx.visitedBits.data(), (tableint) base, (tableint) num};
+    }
+
+    HashVisited hashVisited(SearchContext &ctx, size_t expected) const {
+        size_t capacity = 64;
+        while(capacity < 4 * expected) capacity *= 2;
+        ctx.visitedSlots.assign(capacity, HashVisited::empty);
+        return HashVisited{ctx.visitedSlots, 0};
+    }
+
+    static bool avx2Filtering(){
+#if defined(USE_AVX2)
+        static const bool capable = AVX2Capable();
+        return capable;
+#else
+        return false;
+#endif
+    }
+
+    // Writes the neighbors of a list that are not visited yet to out, marks them visited and
+    // prefetches their vectors; inside[k] tells whether out[k] passes the range filter. With
+    // dropOutside set the neighbors outside the range are skipped and stay unvisited instead.
+    // Returns how many were written.
+    template<bool dropOutside, typename RangeFilter, typename Visited, typename Distance>
+    size_t collectNeighbors(const tableint *datal, size_t size, const RangeFilter &inRange,
+                            Visited &visited, const Distance &dist, tableint *out, char *inside) const {
+#if defined(USE_AVX2)
+        if(avx2Filtering())
+            return collectNeighborsAVX2<dropOutside>(datal, size, inRange, visited, dist, out, inside);
+#endif
+        size_t num = 0;
+        for (size_t j = 0; j < size; j++) {
+            tableint candidate_id = *(datal + j);
+            if (j + 1 < size) visited.prefetch(*(datal + j + 1));
+            if (dropOutside && !inRange.entry(datal, j)) continue;
+            if (visited.testAndSet(candidate_id)) continue;
+#ifdef USE_SSE
+            _mm_prefetch(dist.location(candidate_id), _MM_HINT_T0);
+#endif
+            inside[num] = dropOutside || inRange.entry(datal, j);
+            out[num++] = candidate_id;
+        }
+        return num;
+    }
+
+#if defined(USE_AVX2)
+    // 8 neighbors at a time: their visited state and the range test are gathered into one mask,
+    // only the surviving lanes are visited in scalar code
+    template<bool dropOutside, typename RangeFilter, typename Visited, typename Distance>
+    HNSWLIB_TARGET_AVX2 size_t collectNeighborsAVX2(const tableint *datal, size_t size, const RangeFilter &inRange,
+                                                    Visited &visited, const Distance &dist, tableint *out,
+                                                    char *inside) const {
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        size_t num = 0;
+        for (size_t j = 0; j < size; j += 8) {
+            __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32((int) (size - j)), lanes);
+            __m256i ids = _mm256_maskload_epi32((const int *) (datal + j), active);
+            __m256i keep = _mm256_andnot_si256(visited.seen(ids, active), active);
+            __m256i in = inRange.mask(datal, j, ids, active);
+            if (dropOutside) keep = _mm256_and_si256(keep, in);
+            unsigned bits = _mm256_movemask_ps(_mm256_castsi256_ps(keep));
+            unsigned inBits = _mm256_movemask_ps(_mm256_castsi256_ps(in));
+            while (bits) {
+                int lane = __builtin_ctz(bits);
+                tableint candidate_id = datal[j + lane];
+                bits &= bits - 1;
+                // seen() may not know ids listed twice in the block, or may not look at all
+                if (visited.testAndSet(candidate_id)) continue;
+                _mm_prefetch(dist.location(candidate_id), _MM_HINT_T0);
+                inside[num] = (inBits >> lane) & 1;
+                out[num++] = candidate_id;
+            }
+        }
+        return num;
+    }
+#endif
+
     bool cmp(int a,int b){
         if(valueList_[a]!=valueList_[b]) return valueList_[a]<valueList_[b];
         else return keyList_[a]<keyList_[b];
     }
 
-    struct CompareByFirst {
-        constexpr bool operator()(std::pair<float, tableint> const& a,
-                                  std::pair<float, tableint> const& b) const noexcept {
-            return a.first < b.first;
+    struct CompareByFirst {
+        constexpr bool operator()(std::pair<float, tableint> const& a,
+                                  std::pair<float, tableint> const& b) const noexcept {
+            return a.first < b.first;
+        }
+    };
+
+    typedef std::priority_queue<std::pair<float, tableint>, std::vector<std::pair<float , tableint>>, CompareByFirst> ResultHeap;
+
+    // heap operations on the SearchContext buffers
+    static void pushResult(std::vector<std::pair<float, tableint>> &heap, float dist, tableint id){
+        heap.emplace_back(dist, id);
+        std::push_heap(heap.begin(), heap.end(), CompareByFirst());
+    }
+
+    static void popResult(std::vector<std::pair<float, tableint>> &heap){
+        std::pop_heap(heap.begin(), heap.end(), CompareByFirst());
+        heap.pop_back();
+    }
+
+    static void pushCandidate(std::vector<LayerCandidate> &heap, const LayerCandidate &candidate){
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end());
+    }
+
+    static void popCandidate(std::vector<LayerCandidate> &heap){
+        std::pop_heap(heap.begin(), heap.end());
+        heap.pop_back();
+    }
+
+    Metric metric_{Metric::L2};
+    std::unique_ptr<SpaceInterface<float>> space;
+    size_t data_size_{0};
+
+    DISTFUNC<float> fstdistfunc_;
+    DISTFUNC_BATCH<float> fstdistfunc_batch_{nullptr};
+    void *dist_func_param_{nullptr};
+
+    void initSpace(){
+        if(metric_ == Metric::L2) space.reset(new L2Space(dim));
+        else space.reset(new InnerProductSpace(dim));
+        data_size_ = space->get_data_size();
+        fstdistfunc_ = space->get_dist_func();
+        fstdistfunc_batch_ = space->get_dist_func_batch();
+        dist_func_param_ = space->get_dist_func_param();
+    }
+
+    void normalizeVector(float *v) const {
+        float norm = 0;
+        for(int i = 0; i < dim; i++) norm += v[i] * v[i];
+        if(norm == 0) return;
+        norm = 1.0f / sqrtf(norm);
+        for(int i = 0; i < dim; i++) v[i] *= norm;
+    }
+
+    node* root = nullptr;
+    bool sortedIds_{false};   // internal ids follow attribute order, see renumber
+    bool inlineValues_{false};  // link lists carry neighbor values, see enableInlineValues
+    char* vecData_;
+    std::unique_ptr<SQ8Quantizer> sq8_;
+    std::unique_ptr<PQQuantizer> pq_;
+    uint8_t *codes_{nullptr};    // codes of the active quantizer, codeSize() bytes per element
+    int* keyList_;
+    int* valueList_;
+    bool* isDeleted;
+    int threshold;
+    int M,M0;
+    int skipLayer = 1;
+    int ef_construction;
+    int dim;
+
+    long long numEdges = 0;
+
+
+    float alpha;
+    double mult_{0.0}, revSize_{0.0};
+
+    int maxLayer;
+
+    std::vector<char *> linkLayers_;   // one arena per layer, the list of id at layer l is at linkLayers_[l] + id * sizeLinkList[l]
+
+    // operation log, see openLog
+    struct logFileHeader{
+        unsigned int magic, version, dim;
+    };
+
+    struct logRecord{
+        unsigned long long sequence;
+        unsigned int op, checksum;   // checksum of the record with checksum 0, and the vector
+        int key, value;
+    };
+
+    int logFd_{-1};
+    std::string logLocation_;
+    size_t logSyncEvery_{1}, logPending_{0};
+    unsigned long long logSequence_{0};
+
+    static unsigned int logChecksum(const char *data, size_t size, unsigned int hash = 2166136261u){
+        for(size_t i = 0; i < size; i++) hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+        return hash;
+    }
+
+    static void writeAll(int fd, const void *data, size_t size){
+        const char *p = (const char *) data;
+        while(size > 0){
+            ssize_t n = write(fd, p, size);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) throw std::runtime_error("Cannot write operation log");
+            p += n;
+            size -= n;
+        }
+    }
+
+    // appends an operation under the exclusive latch, true when the log is due for syncLog
+    bool logOperation(unsigned int op, int key, int value, const float *vec){
+        std::lock_guard<std::mutex> lock(logGuard_);
+        if(logFd_ < 0) return false;
+        size_t vecSize = op == RANGEHNSW_LOG_INSERT ? dim * sizeof(float) : 0;
+        std::vector<char> buffer(sizeof(logRecord) + vecSize);
+        logRecord r{logSequence_ + 1, op, 0, key, value};
+        r.checksum = logChecksum((char *) vec, vecSize, logChecksum((char *) &r, sizeof(r)));
+        memcpy(buffer.data(), &r, sizeof(r));
+        if(vecSize) memcpy(buffer.data() + sizeof(r), vec, vecSize);
+        // one write per record, a crash leaves at most the last one torn
+        writeAll(logFd_, buffer.data(), buffer.size());
+        logSequence_++;
+        if(logSyncEvery_ && ++logPending_ >= logSyncEvery_){
+            logPending_ = 0;
+            return true;
+        }
+        return false;
+    }
+
+    // flushes the log after the latch is released, so that queries do not wait for the disk;
+    // the duplicate stays valid if the log is closed meanwhile. Throws when the flush fails.
+    void syncLog(){
+        int fd;
+        std::string location;
+        {
+            std::lock_guard<std::mutex> lock(logGuard_);
+            if(logFd_ < 0) return;
+            fd = dup(logFd_);
+            location = logLocation_;
+        }
+        if(fd < 0)
+            throw std::runtime_error("Cannot write file " + location);
+        bool synced = fdatasync(fd) == 0;
+        close(fd);
+        if(!synced)
+            throw std::runtime_error("Cannot write file " + location);
+    }
+
+    // calls apply on the valid records of the log open at fd, returns the bytes they span with
+    // the file header, 0 for an empty file
+    template<typename Apply>
+    size_t scanLog(int fd, Apply apply) const {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            throw std::runtime_error("Cannot read operation log");
+        size_t fileSize = st.st_size;
+        if (fileSize == 0) return 0;
+        logFileHeader header;
+        if (fileSize < sizeof(header) || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+            header.magic != RANGEHNSW_LOG_MAGIC || header.version != RANGEHNSW_LOG_VERSION ||
+            header.dim != (unsigned int) dim)
+            throw std::runtime_error("Operation log seems to be corrupted or unsupported");
+
+        char *base = (char *) mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+            throw std::runtime_error("Cannot map operation log");
+        const char *data = base + sizeof(header);
+        size_t size = fileSize - sizeof(header), pos = 0;
+        try {
+            while (pos + sizeof(logRecord) <= size) {
+                logRecord r;
+                memcpy(&r, data + pos, sizeof(r));
+                size_t vecSize = r.op == RANGEHNSW_LOG_INSERT ? dim * sizeof(float) : 0;
+                if ((r.op != RANGEHNSW_LOG_INSERT && r.op != RANGEHNSW_LOG_ERASE) ||
+                    pos + sizeof(r) + vecSize > size)
+                    break;
+                unsigned int checksum = r.checksum;
+                r.checksum = 0;
+                const char *vec = data + pos + sizeof(r);
+                if (logChecksum(vec, vecSize, logChecksum((char *) &r, sizeof(r))) != checksum) break;
+                apply(r, (const float *) vec);
+                pos += sizeof(r) + vecSize;
+            }
+        } catch (...) {
+            munmap(base, fileSize);
+            throw;
         }
-    };
+        munmap(base, fileSize);
+        return sizeof(header) + pos;
+    }
 
-    typedef std::priority_queue<std::pair<float, tableint>, std::vector<std::pair<float , tableint>>, CompareByFirst> ResultHeap;
+    std::unique_ptr<VisitedListPool> visited_list_pool_{nullptr};
 
-    hnswlib::L2Space space;
-    size_t data_size_{0};
+    // shared_mutex whose waiting writer keeps new readers out, so that a steady stream of
+    // readers does not starve it
+    struct fairLatch{
+        std::shared_mutex latch;
+        std::mutex gate;    // a waiting writer holds it to stop new readers
 
-    DISTFUNC<float> fstdistfunc_;
-    void *dist_func_param_{nullptr};
+        std::shared_lock<std::shared_mutex> shared(){
+            std::lock_guard<std::mutex> lock(gate);
+            return std::shared_lock<std::shared_mutex>(latch);
+        }
 
-    node* root;
-    char* vecData_;
-    int* keyList_;
-    int* valueList_;
-    bool* isDeleted;
-    int threshold;
-    int M,M0;
-    int skipLayer = 1;
-    int ef_construction;
-    int dim;
+        std::unique_lock<std::shared_mutex> exclusive(){
+            std::lock_guard<std::mutex> lock(gate);
+            return std::unique_lock<std::shared_mutex>(latch);
+        }
+    };
 
-    int numEdges = 0;
+    // Queries hold treeLatch_ shared. Placing a point, changes of entry points and of the arrays
+    // hold it exclusive, each for a short step. The linking step of addPoint reads the tree under
+    // it shared, a node at a time, and holds updateLatch_ shared from placing its point until the
+    // point is linked. erase, resize, renumber, the enable calls, saveIndex and checkpoint hold
+    // updateLatch_ exclusive and so never see an insert half done. Queries never take it, so
+    // they do not wait for the linking, which rebuilds the lists of split nodes. updateLatch_
+    // is always taken before treeLatch_.
+    // Inserts read and write lists under the lock of their element, as hnswlib's construction
+    // does; queries read them without, as in hnswlib's search, and rely on commitList publishing
+    // the count after the ids.
+    mutable fairLatch treeLatch_, updateLatch_;
+    mutable std::vector<std::mutex> linkListLocks_; // one per element, for all its layers
+    mutable std::mutex logGuard_;                   // logFd_ and logPending_
+
+    std::shared_lock<std::shared_mutex> readLatch() const {
+        return treeLatch_.shared();
+    }
 
+    std::unique_lock<std::shared_mutex> writeLatch() const {
+        return treeLatch_.exclusive();
+    }
 
-    float alpha;
-    double mult_{0.0}, revSize_{0.0};
+    std::shared_lock<std::shared_mutex> updateLatch() const {
+        return updateLatch_.shared();
+    }
 
-    int maxLayer;
+    // waits until the inserts in progress are linked and holds back new ones
+    std::unique_lock<std::shared_mutex> drainUpdates() const {
+        return updateLatch_.exclusive();
+    }
 
-    std::vector<char *> linklist;
+    mutable std::mutex contextGuard_;
+    mutable std::vector<std::unique_ptr<SearchContext>> contextPool_;
 
-    std::vector<short int> searchLayer;
-    unsigned int *visited_array;
-    unsigned int tag = 0;
-    std::vector<int> sortedArray;
+    size_t exactScanMin_{256};
+    float exactScanFactor_{2.0f};
 
     std::unordered_map<int,int> key2Id;
 
@@ -264,32 +1645,90 @@ private:
         return Layer % skipLayer;
     }
 
-    int findRight(node* nd){
-        if(nd->layer == 0) return nd->entryPoint;
-        else return findRight(nd->child[nd->keynum]);
+    // recomputes the size and value range of nd from its children
+    void updateSummary(node *nd){
+        if(nd->layer == 0){
+            nd->cnt = 1;
+            nd->minValue = nd->maxValue = valueList_[nd->entryPoint];
+            return;
+        }
+        nd->cnt = 0;
+        for(int i = 0; i <= nd->keynum; i++) nd->cnt += nd->child[i]->cnt;
+        nd->minValue = nd->child[0]->minValue;
+        nd->maxValue = nd->child[nd->keynum]->maxValue;
+    }
+
+    // belongL / belongR are the first and last child of nd holding values in [rangeL, rangeR],
+    // belongL > belongR when no child does
+    void findBelong(const node *nd, int rangeL, int rangeR, int &belongL, int &belongR) const {
+        belongL = nd->keynum;
+        belongR = nd->keynum;
+        for(int i = 0 ; i < nd->keynum; i++){
+            if(rangeL <= nd->child[i]->maxValue){
+                belongL = i;
+                break;
+            }
+        }
+        for(int i = 0 ; i < nd->keynum; i++){
+            if(rangeR < nd->child[i + 1]->minValue){
+                belongR = i;
+                break;
+            }
+        }
+    }
+
+    // number of elements whose value is below v, or at most v with inclusive set
+    size_t countBelow(int v, bool inclusive) const {
+        if(root == nullptr) return 0;
+        size_t count = 0;
+        node *nd = root;
+        while(nd->layer != 0){
+            int i = 0;
+            while(i < nd->keynum && (inclusive ? valueList_[nd->key[i]] <= v : valueList_[nd->key[i]] < v)){
+                count += nd->child[i]->cnt;
+                i++;
+            }
+            nd = nd->child[i];
+        }
+        int value = valueList_[nd->entryPoint];
+        if(inclusive ? value <= v : value < v) count++;
+        return count;
     }
 
+    // callers hold the exclusive tree latch, queries read entry points
     void updateEntry(node *nd){
         std::uniform_int_distribution<> distr(0,  nd->keynum);
         nd->entryPoint = nd->child[distr(eng)]->entryPoint;
     }
 
-    node* buildTree(int eleNum){
+    struct buildTask{
+        int pos;        // position in sorted
+        int nodeId;     // index of the parent node in the current layer
+        int childId;    // child of the parent node the element belongs to
+    };
+
+    // builds the tree over the ids of sorted, which are in attribute order
+    node* buildTree(const std::vector<int> &sorted){
+        int eleNum = sorted.size();
         std::queue<std::pair< std::pair<int,int>, node* > > q[2];
         int qid = 0;
         for(int i = 0; i < eleNum; i++){
-            node *nd = new node();
+            node *nd = newNode();
             nd->layer = 0;
-            nd->entryPoint = sortedArray[i];
+            nd->entryPoint = sorted[i];
+            updateSummary(nd);
             q[qid].push({{i, i}, nd});
-            unsigned int *newListData = (unsigned int *) get_linklist(sortedArray[i], 0);
+            unsigned int *newListData = (unsigned int *) get_linklist(sorted[i], 0);
 
-            setListCount(newListData, 0);
+            commitList(newListData, 0, 0);
 
         }
         while(q[qid].size() > 1){
             std::cout<<"layer:"<<q[qid].front().second->layer<<std::endl;
             int nxtqid = qid ^ 1;
+            std::vector<node*> layerNodes;
+            std::vector<buildTask> tasks;
+            tasks.reserve(eleNum);
             while(!q[qid].empty()){
                 std::vector<std::pair<int,int>> tmp;
                 // int numChild = (q[qid].size() >= 2 * BTREE_D) ? BTREE_D : q[qid].size();
@@ -305,67 +1744,83 @@ private:
                 }
                 tmp.reserve(numChild);
                 tmp.resize(numChild);
-                node* nd = new node();
+                node* nd = newNode();
                 nd->keynum = numChild - 1 ;
                 for(int i = 0; i < numChild; i++){
                     auto t = q[qid].front();
                     tmp[i] = t.first;
                     q[qid].pop();
                     if (i != 0){
-                        nd->key[i - 1] = sortedArray[tmp[i].first];
+                        nd->key[i - 1] = sorted[tmp[i].first];
                     }
                     nd->child[i] = t.second;
                 }
                 std::uniform_int_distribution<> distr(0, numChild - 1);
                 nd->entryPoint = nd->child[distr(eng)]->entryPoint;
-                int layer = nd->layer = nd->child[0]->layer + 1;
-
-                for(int i = 0; i < numChild; i++) {
-                    for (int ii = tmp[i].first; ii <= tmp[i].second; ii++) {
-                        int id = sortedArray[ii];
-                        ResultHeap candidates;
-                        char *data = getDataByInternalId(id);
-                        unsigned int *listData = (unsigned int *) get_linklist(id, layer - 1);
-                        int size = getListCount(listData);
-
-                        tableint *listD = (tableint *) (listData + 1);
-                        for (int j = 0; j < size; j++) {
-                            candidates.emplace(
-                                    fstdistfunc_(data, getDataByInternalId(listD[j]),
-                                                 dist_func_param_), listD[j]);
-                        }
-                        for (int j = 0; j < numChild; j++)
-                            if (i != j) {
-                                tableint ep_id = findEntry(data, nd->child[j], nd->child[j]->entryPoint);
-                                std::vector<tableint >ep_ids = {ep_id};
-                                ResultHeap r = searchBaseLayer(ep_ids, data, layer - 1);
-                                getNeighborsByHeuristic2(r, M);
-                                while (!r.empty()) {
-                                    auto pr = r.top();
-                                    r.pop();
-                                    candidates.push(pr);
-                                }
-                            }
-                        getNeighborsByHeuristic2(candidates, M);
+                nd->layer = nd->child[0]->layer + 1;
+                updateSummary(nd);
 
-                        unsigned int *newListData = (unsigned int *) get_linklist(id, layer);
+                int nodeId = layerNodes.size();
+                layerNodes.push_back(nd);
+                for(int i = 0; i < numChild; i++)
+                    for (int ii = tmp[i].first; ii <= tmp[i].second; ii++)
+                        tasks.push_back({ii, nodeId, i});
 
-                        tableint *newListD = (tableint *) (newListData + 1);
-                        int indx = 0;
-                        while (candidates.size() > 0) {
-                            newListD[indx] = candidates.top().second;
-                            candidates.pop();
-                            indx++;
-                        }
+                q[nxtqid].push({{tmp[0].first,tmp[tmp.size() - 1].second}, nd});
+            }
 
-                        //    std::cout<<id<<" in layer "<<nd->layer<<" has "<<indx<<" edges"<<std::endl;
+            // every element of this layer only reads the lists of layer - 1 and writes its own list of layer,
+            // so the elements can be linked concurrently
+            long long layerEdges = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:layerEdges)
+            for(size_t t = 0; t < tasks.size(); t++) {
+                node *nd = layerNodes[tasks[t].nodeId];
+                int i = tasks[t].childId;
+                int numChild = nd->keynum + 1;
+                int layer = nd->layer;
+
+                int id = sorted[tasks[t].pos];
+                ResultHeap candidates;
+                char *data = getDataByInternalId(id);
+                unsigned int *listData = (unsigned int *) get_linklist(id, layer - 1);
+                int size = getListCount(listData);
 
-                        setListCount(newListData, indx);
-                        numEdges += indx;
+                tableint *listD = (tableint *) (listData + 1);
+                for (int j = 0; j < size; j++) {
+                    candidates.emplace(
+                            fstdistfunc_(data, getDataByInternalId(listD[j]),
+                                         dist_func_param_), listD[j]);
+                }
+                for (int j = 0; j < numChild; j++)
+                    if (i != j) {
+                        tableint ep_id = findEntry(data, layer - 1, nd->child[j]->entryPoint);
+                        std::vector<tableint >ep_ids = {ep_id};
+                        ResultHeap r = searchBaseLayer(ep_ids, data, layer - 1);
+                        getNeighborsByHeuristic2(r, maxM_[layer]);
+                        while (!r.empty()) {
+                            auto pr = r.top();
+                            r.pop();
+                            candidates.push(pr);
+                        }
                     }
+                getNeighborsByHeuristic2(candidates, maxM_[layer]);
+
+                unsigned int *newListData = (unsigned int *) get_linklist(id, layer);
+
+                tableint *newListD = (tableint *) (newListData + 1);
+                int indx = 0;
+                while (candidates.size() > 0) {
+                    newListD[indx] = candidates.top().second;
+                    candidates.pop();
+                    indx++;
                 }
-                q[nxtqid].push({{tmp[0].first,tmp[tmp.size() - 1].second}, nd});
+
+                //    std::cout<<id<<" in layer "<<nd->layer<<" has "<<indx<<" edges"<<std::endl;
+
+                commitList(newListData, indx, layer);
+                layerEdges += indx;
             }
+            numEdges += layerEdges;
 
             qid = nxtqid;
         }
@@ -384,30 +1839,73 @@ private:
     }
 
 
-    void addPoint(int id){
+    // Adds id to the tree, the halves of every node split on the way go to stale, bottom up.
+    // Returns false when id is the first point and has nothing to link to.
+    bool placePoint(int id, std::vector<node *> &stale){
         if (root == NULL)
         {
             // Allocate memory for root
-            root = new node();
+            root = newNode();
             root->keynum = 1;  // Update number of keys in root
+            return false;
         }
         else // If tree is not empty
         {
-            insert(root, id);
+            insert(root, id, stale);
             if(root->keynum == BTREE_M){
-                node *newRoot = new node();
+                node *newRoot = newNode();
                 newRoot->layer = root->layer + 1;
                 newRoot->keynum = 0;
                 newRoot->child[0] = root;
                 root = newRoot;
-                for(int i = 0; i < eleCount; i++){
-                    memcpy(linklist[i] + root->layer *sizeLinkList, linklist[i] + (root->layer - 1) *sizeLinkList, sizeLinkList);
-                }
-                splitNode(newRoot,0);
+                copyLayer(root->layer - 1, root->layer);
+                splitNode(newRoot, 0, stale);
                 // refresh(newRoot);
                 // root = newRoot;
             }
         }
+        return true;
+    }
+
+    // Links id at every layer of its path, bottom up. The lists of a stale node are rebuilt
+    // before id is linked in the layer above it, as when the split happened during the insert.
+    // Runs under the shared update latch only. The tree is read under the shared tree latch in
+    // short steps, since other inserts place their points meanwhile and may split its nodes.
+    void linkPoint(tableint id, const std::vector<node *> &stale){
+        int topLayer;
+        tableint ep_id;
+        {
+            std::shared_lock<std::shared_mutex> latch = readLatch();
+            node *bottom = root;
+            while(bottom->layer != 1) bottom = bottom->child[childOf(bottom, id)];
+            topLayer = root->layer;
+            ep_id = bottom->entryPoint;
+            if(ep_id == id) ep_id = bottom->child[bottom->child[0]->entryPoint == id ? 1 : 0]->entryPoint;
+        }
+        char *data = getDataByInternalId(id);
+
+        for(int layer = 1; layer <= topLayer; layer++){
+            // the layer of a node never changes, and only erase retires nodes
+            for(node *nd : stale)
+                if(nd->layer == layer - 1 && !nd->retired) refreshStale(nd);
+
+            std::vector<tableint >ep_ids = {ep_id};
+            ResultHeap found = searchBaseLayer(ep_ids, data, layer);
+            // a refresh of another insert may have linked id already
+            ResultHeap candidates;
+            for(; !found.empty(); found.pop())
+                if(found.top().second != id) candidates.push(found.top());
+            if(candidates.empty()) continue;
+            getNeighborsByHeuristic2(candidates, maxM_[layer]);
+            ep_id = connectEdges(data, id, candidates, layer);
+        }
+    }
+
+    // child of nd whose subtree holds id
+    int childOf(const node *nd, int id){
+        for(int i = 0 ; i < nd->keynum; i++)
+            if(cmp(id, nd->key[i])) return i;
+        return nd->keynum;
     }
 
 
@@ -429,6 +1927,7 @@ private:
                 nd->child[i] = nd->child[i +1];
             }
             nd->keynum --;
+            updateSummary(nd);
             return;
         }
         else {
@@ -450,6 +1949,8 @@ private:
 
                     nd->key[belong - 1] = nd2->key[nd2->keynum - 1];
                     nd2->keynum --;
+                    updateSummary(nd1);
+                    updateSummary(nd2);
 
                     refresh(nd1, 0);
                     refresh(nd2);
@@ -469,6 +1970,8 @@ private:
                         nd2->child[i] = nd2->child[i + 1];
                     }
                     nd2->keynum --;
+                    updateSummary(nd1);
+                    updateSummary(nd2);
 
                     refresh(nd1, nd1->keynum);
 
@@ -481,6 +1984,7 @@ private:
                     mergeNode(nd, belong);
                 }
             }
+            updateSummary(nd);
         }
     }
 
@@ -496,27 +2000,18 @@ private:
             char *data = getDataByInternalId(id);
 
             if (belong == refreshId) {
-                unsigned int *listData = (unsigned int *) get_linklist(id, layer - 1);
-                int size = getListCount(listData);
-
-                tableint *listD = (tableint *) (listData + 1);
-                for (int j = 0; j < size; j++) {
-                    if (!isDeleted[listD[j]])
-                        candidates.emplace(
-                                fstdistfunc_(data, getDataByInternalId(listD[j]),
-                                             dist_func_param_), listD[j]);
-                }
+                addLiveNeighbors(id, layer - 1, data, candidates);
 
                 for (int j = 0; j <= nd->keynum; j++)
                     if (j != belong) {
 
                         std::vector<tableint> ep_ids;
                         if (ep_ids.size() == 0) {
-                            tableint ep_id = findEntry(data, nd->child[j], nd->child[j]->entryPoint);
+                            tableint ep_id = findEntry(data, layer - 1, nd->child[j]->entryPoint);
                             ep_ids.push_back(ep_id);
                         }
                         ResultHeap r = searchBaseLayer(ep_ids, data, layer - 1);
-                        getNeighborsByHeuristic2(r, M);
+                        getNeighborsByHeuristic2(r, maxM_[layer]);
                         while (!r.empty()) {
                             auto pr = r.top();
                             r.pop();
@@ -525,31 +2020,23 @@ private:
                     }
             }
             else{
-                unsigned int *listData = (unsigned int *) get_linklist(id, layer);
-                int size = getListCount(listData);
-
-                tableint *listD = (tableint *) (listData + 1);
-                for (int j = 0; j < size; j++) {
-                    if (!isDeleted[listD[j]])
-                        candidates.emplace(
-                                fstdistfunc_(data, getDataByInternalId(listD[j]),
-                                             dist_func_param_), listD[j]);
-                }
+                addLiveNeighbors(id, layer, data, candidates);
 
                 std::vector<tableint> ep_ids;
                 if (ep_ids.size() == 0) {
-                    tableint ep_id = findEntry(data, nd->child[refreshId], nd->child[refreshId]->entryPoint);
+                    tableint ep_id = findEntry(data, layer - 1, nd->child[refreshId]->entryPoint);
                     ep_ids.push_back(ep_id);
                 }
                 ResultHeap r = searchBaseLayer(ep_ids, data, layer - 1);
-                getNeighborsByHeuristic2(r, M);
+                getNeighborsByHeuristic2(r, maxM_[layer]);
                 while (!r.empty()) {
                     auto pr = r.top();
                     r.pop();
                     candidates.push(pr);
                 }
             }
-            getNeighborsByHeuristic2(candidates, M);
+            getNeighborsByHeuristic2(candidates, maxM_[layer]);
+            std::lock_guard<std::mutex> lock(linkListLocks_[id]);
             unsigned int *newListData = (unsigned int *) get_linklist(id, layer);
 
             tableint *newListD = (tableint *) (newListData + 1);
@@ -559,11 +2046,27 @@ private:
                 candidates.pop();
                 indx++;
             }
-            setListCount(newListData, indx);
+            commitList(newListData, indx, layer);
         }
         updateEntry(nd);
     }
 
+    // adds the live neighbors of id at layer with their distance to data, read under the
+    // element lock since other inserts may rewrite the list meanwhile
+    void addLiveNeighbors(tableint id, int layer, const char *data, ResultHeap &candidates){
+        std::lock_guard<std::mutex> lock(linkListLocks_[id]);
+        linklistsizeint *listData = get_linklist(id, layer);
+        int size = getListCount(listData);
+
+        tableint *listD = (tableint *) (listData + 1);
+        for (int j = 0; j < size; j++) {
+            if (!isDeleted[listD[j]])
+                candidates.emplace(
+                        fstdistfunc_(data, getDataByInternalId(listD[j]),
+                                     dist_func_param_), listD[j]);
+        }
+    }
+
     void mergeNode(node *nd, int mergeId){
         node* n1 = nd->child[mergeId];
         node* n2 = nd->child[mergeId + 1];
@@ -575,6 +2078,8 @@ private:
             n1->child[i + n1->keynum + 1] = n2->child[i];
         }
         n1->keynum += n2->keynum + 1;
+        n2->retired = true;
+        updateSummary(n1);
         refresh(n1);
         for(int i = mergeId; i < nd->keynum; i++){
             nd->key[i] = nd->key[i + 1];
@@ -583,31 +2088,27 @@ private:
             nd->child[i] = nd->child[i + 1];
         }
         nd->keynum --;
+        updateSummary(nd);
         updateEntry(nd);
     }
 
-    tableint insert(node* nd, int id){
-        int belong = nd->keynum;
-        for(int i = 0 ; i < nd->keynum; i++){
-            if( cmp(id, nd->key[i])){
-                belong = i;
-                break;
-            }
-        }
-        tableint ep_id;
+    // structural part of an insert, the graphs are left to linkPoint
+    void insert(node* nd, int id, std::vector<node *> &stale){
+        int belong = childOf(nd, id);
         if(nd->layer == 1){
-            node *newnd = new node();
+            node *newnd = newNode();
             newnd->layer = 0;
             newnd->entryPoint = id;
+            updateSummary(newnd);
 
             unsigned int *newListData = (unsigned int *) get_linklist(id, 1);
             tableint *newListD = (tableint *) (newListData + 1);
             int indx = 0;
-            for(int i = 0; i <=nd->keynum; i++){
+            for(int i = 0; i <=nd->keynum && indx < maxM_[1]; i++){
                 newListD[indx] = nd->child[i]->entryPoint;
                 indx++;
             }
-            setListCount(newListData, indx);
+            commitList(newListData, indx, 1);
 
             for(int i = nd->keynum -1; i >= belong; i --){
                 nd->key[i + 1] = nd->key[i];
@@ -623,24 +2124,20 @@ private:
             nd->key[belong] = newnd->entryPoint;
             nd->keynum ++;
             nd->child[belong + 1] = newnd;
-            ep_id = nd->entryPoint;
         }
         else {
-            ep_id = insert(nd->child[belong], id);
+            insert(nd->child[belong], id, stale);
             if (nd->child[belong]->keynum == BTREE_M) {
-                splitNode(nd, belong);
+                splitNode(nd, belong, stale);
             }
         }
-        std::vector<tableint >ep_ids = {ep_id};
-        char *data = getDataByInternalId(id);
-        auto candidates = searchBaseLayer(ep_ids, data,nd->layer);
-        getNeighborsByHeuristic2(candidates,M);
-        return connectEdges(data,id,candidates, nd->layer);
+        updateSummary(nd);
     }
 
-    void splitNode(node *nd, int splitId){
+    // the lists of both halves are left to the caller, which gets them in stale
+    void splitNode(node *nd, int splitId, std::vector<node *> &stale){
         node* n1 = nd->child[splitId];
-        node* n2 = new node();
+        node* n2 = newNode();
         n2->layer = n1->layer;
         n2->keynum = 0;
         int splitPoint = n1->keynum/2;
@@ -653,8 +2150,13 @@ private:
         }
         n2->keynum = n1->keynum - splitPoint - 1;
         n1->keynum = splitPoint;
-        refresh(n1);
-        refresh(n2);
+        updateSummary(n1);
+        updateSummary(n2);
+        // entry points that stay inside each half until the refresh picks them again
+        updateEntry(n1);
+        updateEntry(n2);
+        stale.push_back(n1);
+        stale.push_back(n2);
         for(int i = nd->keynum -1; i >= splitId; i --){
             nd->key[i + 1] = nd->key[i];
         }
@@ -664,63 +2166,99 @@ private:
         nd->keynum ++;
         nd->key[splitId] = newKey;
         nd->child[splitId + 1] = n2;
+        updateSummary(nd);
         updateEntry(nd);
     }
 
 
+    // what a refresh reads of a node: its elements in attribute order, its separators and the
+    // entry points of its children
+    struct nodeView{
+        int layer, keynum;
+        int key[BTREE_M];
+        tableint childEntry[BTREE_M + 1];
+        std::vector<tableint> ids;
+    };
+
+    nodeView viewNode(node *nd){
+        nodeView view;
+        view.layer = nd->layer;
+        view.keynum = nd->keynum;
+        memcpy(view.key, nd->key, sizeof(view.key));
+        for(int j = 0; j <= nd->keynum; j++) view.childEntry[j] = nd->child[j]->entryPoint;
+        traverse(view.ids, nd);
+        return view;
+    }
+
     void refresh(node *nd){
-        std::vector<tableint> tmp;
-        traverse(tmp,nd);
-        int layer = nd->layer;
+        rebuildLists(viewNode(nd));
+        updateEntry(nd);
+    }
+
+    // refresh of a split half by linkPoint, which holds no tree latch: the node is read under
+    // the shared latch and its lists are rebuilt without it, while other inserts go on placing
+    // their points and may split it again, which leaves it to their own refresh
+    void refreshStale(node *nd){
+        nodeView view;
+        {
+            std::shared_lock<std::shared_mutex> latch = readLatch();
+            view = viewNode(nd);
+        }
+        rebuildLists(view);
+        std::unique_lock<std::shared_mutex> latch = writeLatch();
+        updateEntry(nd);
+    }
+
+    // rebuilds the lists of the elements of a node at its layer
+    void rebuildLists(const nodeView &nd){
+        const std::vector<tableint> &tmp = nd.ids;
+        int layer = nd.layer;
         int belong = 0;
         for(int i = 0 ; i < tmp.size(); i++){
             tableint id = tmp[i];
-            if(belong<nd->keynum&&(!cmp(id,nd->key[belong]))) belong++;
+            if(belong<nd.keynum&&(!cmp(id,nd.key[belong]))) belong++;
             ResultHeap candidates;
             char *data = getDataByInternalId(id);
 
-            unsigned int *prelistData = (unsigned int *) get_linklist(id, layer);
-            int presize = getListCount(prelistData);
-
-            tableint *prelistD = (tableint *) (prelistData + 1);
-
-
-            unsigned int *listData = (unsigned int *) get_linklist(id, layer - 1);
-            int size = getListCount(listData);
-
-            tableint *listD = (tableint *) (listData + 1);
-            for (int j = 0; j < size; j++) {
-                if(!isDeleted[listD[j]])
-                    candidates.emplace(
-                            fstdistfunc_(data, getDataByInternalId(listD[j]),
-                                         dist_func_param_), listD[j]);
+            // the old list seeds the searches in the other children
+            std::vector<tableint> prelist;
+            {
+                std::lock_guard<std::mutex> lock(linkListLocks_[id]);
+                linklistsizeint *prelistData = get_linklist(id, layer);
+                tableint *prelistD = (tableint *) (prelistData + 1);
+                prelist.assign(prelistD, prelistD + getListCount(prelistData));
             }
+            int presize = prelist.size();
+            const tableint *prelistD = prelist.data();
 
-            for(int j = 0; j <= nd->keynum; j++)
+            addLiveNeighbors(id, layer - 1, data, candidates);
+
+            for(int j = 0; j <= nd.keynum; j++)
                 if(j!=belong){
 
                     std::vector<tableint >ep_ids;
                     for (int k = 0; k < presize; k++) {
                         if(!isDeleted[prelistD[k]])
-                            if((j == 0 && (!cmp(prelistD[k],tmp[0]))|| ((j!=0)&&(!cmp(prelistD[k],nd->key[j - 1])))))
-                                if((j == nd->keynum && cmp(prelistD[k], tmp[tmp.size() - 1]))|| ((j!=nd->keynum)&&cmp(prelistD[k], nd->key[j]))){
+                            if((j == 0 && (!cmp(prelistD[k],tmp[0]))|| ((j!=0)&&(!cmp(prelistD[k],nd.key[j - 1])))))
+                                if((j == nd.keynum && cmp(prelistD[k], tmp[tmp.size() - 1]))|| ((j!=nd.keynum)&&cmp(prelistD[k], nd.key[j]))){
                                     ep_ids.push_back(prelistD[k]);
                                 }
                     }
                     if(ep_ids.size() == 0) {
-                        tableint ep_id = findEntry(data, nd->child[j], nd->child[j]->entryPoint);
+                        tableint ep_id = findEntry(data, layer - 1, nd.childEntry[j]);
                         ep_ids.push_back(ep_id);
                     }
                     ResultHeap r = searchBaseLayer(ep_ids, data, layer - 1);
-                    getNeighborsByHeuristic2(r, M);
+                    getNeighborsByHeuristic2(r, maxM_[layer]);
                     while (!r.empty()) {
                         auto pr = r.top();
                         r.pop();
                         candidates.push(pr);
                     }
                 }
-            getNeighborsByHeuristic2(candidates, M);
+            getNeighborsByHeuristic2(candidates, maxM_[layer]);
 
+            std::lock_guard<std::mutex> lock(linkListLocks_[id]);
             unsigned int *newListData = (unsigned int *) get_linklist(id, layer);
 
             tableint *newListD = (tableint *) (newListData + 1);
@@ -730,9 +2268,8 @@ private:
                 candidates.pop();
                 indx++;
             }
-            setListCount(newListData, indx);
+            commitList(newListData, indx, layer);
         }
-        updateEntry(nd);
     }
 
     tableint connectEdges(
@@ -742,7 +2279,7 @@ private:
             int layer) {
 
         std::vector<tableint> selectedNeighbors;
-        selectedNeighbors.reserve(M);
+        selectedNeighbors.reserve(maxM_[layer]);
         while (top_candidates.size() > 0) {
             selectedNeighbors.push_back(top_candidates.top().second);
             top_candidates.pop();
@@ -751,25 +2288,26 @@ private:
         tableint next_closest_entry_point = selectedNeighbors.back();
 
         {
+            std::lock_guard<std::mutex> lock(linkListLocks_[cur_c]);
             linklistsizeint *ll_cur = get_linklist(cur_c, layer);
 
-            setListCount(ll_cur, selectedNeighbors.size());
             tableint *data = (tableint *) (ll_cur + 1);
             for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
                 data[idx] = selectedNeighbors[idx];
             }
+            commitList(ll_cur, selectedNeighbors.size(), layer);
         }
 
         for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-
+            std::lock_guard<std::mutex> lock(linkListLocks_[selectedNeighbors[idx]]);
             linklistsizeint *ll_other = get_linklist(selectedNeighbors[idx], layer);
 
             size_t sz_link_list_other = getListCount(ll_other);
 
             tableint *data = (tableint *) (ll_other + 1);
-            if (sz_link_list_other < M) {
+            if (sz_link_list_other < maxM_[layer]) {
                 data[sz_link_list_other] = cur_c;
-                setListCount(ll_other, sz_link_list_other + 1);
+                commitList(ll_other, sz_link_list_other + 1, layer);
             } else {
                 // finding the "weakest" element to replace it with the new one
                 float d_max = fstdistfunc_(getDataByInternalId(cur_c), getDataByInternalId(selectedNeighbors[idx]),
@@ -784,7 +2322,7 @@ private:
                                          dist_func_param_), data[j]);
                 }
 
-                getNeighborsByHeuristic2(candidates, M);
+                getNeighborsByHeuristic2(candidates, maxM_[layer]);
 
                 int indx = 0;
                 while (candidates.size() > 0) {
@@ -793,34 +2331,196 @@ private:
                     indx++;
                 }
 
-                setListCount(ll_other, indx);
+                commitList(ll_other, indx, layer);
             }
         }
 
         return next_closest_entry_point;
     }
 
-    node* findHighNode(node* node,int rangeL, int rangeR){
-        if(node->layer == 0){
-            return node;
+    // leaves the ef_s closest internal ids in [rangeL, rangeR] in ctx.results, farthest on top
+    void searchRange(SearchContext &ctx, const float *vecData, int rangeL, int rangeR, int ef_s) const {
+        ctx.results.clear();
+        if(metric_ == Metric::Cosine){
+            ctx.normalized.assign(vecData, vecData + dim);
+            normalizeVector(ctx.normalized.data());
+            vecData = ctx.normalized.data();
         }
-        int belongL = node->keynum;
-        int belongR = node->keynum;
-        for(int i = 0 ; i < node->keynum; i++){
-            if(rangeL < valueList_[node->key[i]] ||
-               (rangeL == valueList_[node->key[i]] && (rangeL == valueList_[findRight(node->child[i])]))){
-                belongL = i;
-                break;
-            }
+        if(rangeL > rangeR) return;
+        // both counts are O(log n): a binary search over the ids after renumber, the subtree
+        // sizes of the tree otherwise
+        size_t num = sortedIds_ ? idsBelow(rangeR, true) - idsBelow(rangeL, false)
+                                : countBelow(rangeR, true) - countBelow(rangeL, false);
+        if(num == 0) return;
+        if(num <= std::max<size_t>(exactScanMin_, exactScanFactor_ * ef_s))
+            exactScan(ctx, vecData, rangeL, rangeR, ef_s);
+        else
+            searchGraph(ctx, vecData, rangeL, rangeR, ef_s);
+    }
+
+    // number of ids whose value is below v, or at most v with inclusive set. Only valid when
+    // sortedIds_ is set, erased ids are counted as well.
+    size_t idsBelow(int v, bool inclusive) const {
+        size_t lo = 0, hi = eleCount;
+        while(lo < hi){
+            size_t mid = (lo + hi) / 2;
+            if(inclusive ? valueList_[mid] <= v : valueList_[mid] < v) lo = mid + 1;
+            else hi = mid;
         }
-        for(int i = 0 ; i < node->keynum; i++){
-            if(rangeR < valueList_[node->key[i]]){
-                belongR = i;
-                break;
+        return lo;
+    }
+
+    // appends the leaves below nd with values in [rangeL, rangeR] to ids in attribute order,
+    // stops at limit ids
+    void collectLeaves(const node *nd, int rangeL, int rangeR, std::vector<tableint> &ids, size_t limit) const {
+        if(ids.size() >= limit || nd->maxValue < rangeL || nd->minValue > rangeR) return;
+        if(nd->layer == 0){
+            ids.push_back(nd->entryPoint);
+            return;
+        }
+        for(int i = 0; i <= nd->keynum; i++) collectLeaves(nd->child[i], rangeL, rangeR, ids, limit);
+    }
+
+    // ef_s closest among the points in [rangeL, rangeR], or among the first limit of them.
+    // With the vectors on disk the scan runs on the codes and only the ef_s best are read.
+    void exactScan(SearchContext &ctx, const float *vecData, int rangeL, int rangeR, int ef_s,
+                   size_t limit = std::numeric_limits<size_t>::max()) const {
+        // after renumber the points are a slice of the ids, otherwise they are the leaves of the range
+        std::vector<tableint> &ids = ctx.scanIds;
+        ids.clear();
+        if(sortedIds_){
+            size_t lo = idsBelow(rangeL, false), hi = idsBelow(rangeR, true);
+            for(size_t id = lo; id < hi && ids.size() < limit; id++)
+                if(!isDeleted[id]) ids.push_back(id);
+        }
+        else collectLeaves(root, rangeL, rangeR, ids, limit);
+
+        if(diskVectors_)
+            searchCodes(ctx, vecData, [&](const auto &dist) { exactScanBy(ctx, dist, ef_s); });
+        else exactScanBy(ctx, ExactDistance{this, vecData}, ef_s);
+    }
+
+    // scores the points of ctx.scanIds
+    template<typename Distance>
+    void exactScanBy(SearchContext &ctx, const Distance &dist, int ef_s) const {
+        std::vector<std::pair<float, tableint>> &top_candidates = ctx.results;
+        const std::vector<tableint> &ids = ctx.scanIds;
+        float lowerBound = std::numeric_limits<float>::max();
+        for(size_t p = 0; p < ids.size(); p++){
+            tableint id = ids[p];
+#ifdef USE_SSE
+            if(p + 1 < ids.size()) _mm_prefetch(dist.location(ids[p + 1]), _MM_HINT_T0);
+#endif
+            float d = dist(id);
+            if(top_candidates.size() < ef_s || d < lowerBound){
+                pushResult(top_candidates, d, id);
+                if(top_candidates.size() > ef_s) popResult(top_candidates);
+                lowerBound = top_candidates.front().first;
             }
         }
-        if(belongL == belongR) return findHighNode(node->child[belongL], rangeL, rangeR);
-        return node;
+    }
+
+    void searchGraph(SearchContext &ctx, const float *vecData, int rangeL, int rangeR, int ef_s) const {
+        if(sq8_ || pq_)
+            searchCodes(ctx, vecData, [&](const auto &dist) { searchGraphBy(ctx, dist, rangeL, rangeR, ef_s); });
+        else searchGraphBy(ctx, ExactDistance{this, vecData}, rangeL, rangeR, ef_s);
+    }
+
+    // runs search with the distance of the active quantizer, then re-ranks the candidates
+    // on the full vectors
+    template<typename Search>
+    void searchCodes(SearchContext &ctx, const float *vecData, Search search) const {
+        if(sq8_){
+            ctx.prepared.resize(sq8_->dim());
+            sq8_->prepare(vecData, ctx.prepared.data());
+            search(SQ8Distance{sq8_.get(), ctx.prepared.data(), codes_});
+        }
+        else{
+            pq_->prepare(vecData, ctx.pqTable);
+            search(PQDistance{pq_.get(), &ctx.pqTable, codes_});
+        }
+        rerank(ctx, vecData);
+    }
+
+    // replaces the distances in ctx.results by exact ones
+    void rerank(SearchContext &ctx, const float *vecData) const {
+        size_t n = ctx.results.size();
+        if(diskVectors_){
+            // all candidates are read in one batch
+            ctx.batchIds.resize(std::max<size_t>(n, ctx.batchIds.size()));
+            ctx.rows.resize(n * data_size_);
+            for(size_t i = 0; i < n; i++) ctx.batchIds[i] = ctx.results[i].second;
+            diskVectors_->fetch(ctx.batchIds.data(), n, ctx.rows.data());
+            for(size_t i = 0; i < n; i++)
+                ctx.results[i].first = fstdistfunc_(vecData, ctx.rows.data() + i * data_size_, dist_func_param_);
+        }
+        else {
+            for(size_t i = 0; i < n; i++)
+                ctx.results[i].first = fstdistfunc_(vecData, getDataByInternalId(ctx.results[i].second), dist_func_param_);
+        }
+        std::make_heap(ctx.results.begin(), ctx.results.end(), CompareByFirst());
+    }
+
+    template<typename Distance>
+    void searchGraphBy(SearchContext &ctx, const Distance &dist, int rangeL, int rangeR, int ef_s) const {
+        // descend while the range falls into a single child
+        node* highNode = root;
+        int belongL, belongR;
+        findBelong(highNode, rangeL, rangeR, belongL, belongR);
+        while(highNode->layer != 0 && belongL == belongR){
+            highNode = highNode->child[belongL];
+            findBelong(highNode, rangeL, rangeR, belongL, belongR);
+        }
+        if(belongL > belongR) return;
+        tableint ep_ids[2];
+        short int ep_layers[2];
+        int ep_num = 0;
+        if(belongL == belongR) {
+            // a single leaf
+            if(highNode->minValue >= rangeL && highNode->maxValue <= rangeR)
+                pushResult(ctx.results, dist(highNode->entryPoint), highNode->entryPoint);
+            return;
+        }
+        int sp;
+        if(belongL == belongR - 1){
+            node* nodeL = highNode->child[belongL];
+            while(nodeL->layer != 0 && nodeL->child[nodeL->keynum - 1]->maxValue < rangeL) nodeL = nodeL->child[nodeL->keynum];
+            tableint ep1 = nodeL->layer != 0 ? findEntryBy(dist,nodeL,nodeL->child[nodeL->keynum]->entryPoint) : nodeL->entryPoint;
+            ep_ids[ep_num] = ep1;
+            ep_layers[ep_num++] = nodeL->layer;
+            sp = highNode->key[belongL];
+
+            node* nodeR = highNode->child[belongR];
+            while(nodeR->layer != 0 && nodeR->child[1]->minValue > rangeR) nodeR = nodeR->child[0];
+            tableint ep2 = nodeR->layer != 0 ? findEntryBy(dist,nodeR,nodeR->child[0]->entryPoint) : nodeR->entryPoint;
+            ep_ids[ep_num] = ep2;
+            ep_layers[ep_num++] = nodeR->layer;
+        }
+        else{
+            sp = -1;
+            std::uniform_int_distribution<> distr(belongL + 1, belongR -1);
+            tableint high_ep = highNode->child[distr(ctx.eng)]->entryPoint;
+            tableint ep = findEntryBy(dist,highNode, high_ep);
+            ep_ids[ep_num] = ep;
+            ep_layers[ep_num++] = highNode->layer;
+        }
+        auto search = [&](const auto &inRange, auto &&visited){
+            searchBaseLayer0(ctx, ep_ids, ep_layers, ep_num, dist, highNode->layer, inRange, visited, ef_s, sp);
+        };
+        auto searchIn = [&](const auto &inRange){
+            if(highNode->cnt <= RANGEHNSW_HASH_VISITED_MAX) search(inRange, hashVisited(ctx, highNode->cnt));
+            else search(inRange, epochVisited(ctx));
+        };
+        if(sortedIds_){
+            // ids are in attribute order, the range holds [lo, hi) and the subtree of highNode [first, last)
+            size_t lo = idsBelow(rangeL, false), hi = idsBelow(rangeR, true);
+            IdRangeFilter inRange{(tableint) lo, (tableint) (hi - lo)};
+            size_t first = idsBelow(highNode->minValue, false), last = idsBelow(highNode->maxValue, true);
+            if(last - first <= RANGEHNSW_BITSET_VISITED_MAX) search(inRange, bitsetVisited(ctx, first, last - first));
+            else searchIn(inRange);
+        }
+        else if(inlineValues_) searchIn(InlineValueFilter{valueList_, rangeL, rangeR, maxM_.data(), 0});
+        else searchIn(ValueRangeFilter{valueList_, rangeL, rangeR});
     }
 
 
@@ -871,10 +2571,19 @@ private:
     }
 
     ResultHeap searchBaseLayer(const std::vector<tableint> &ep_ids, const void *data_point, int layer) {
-        tag ++;
+        VisitedList *vl = visited_list_pool_->getFreeVisitedList();
+        vl_type *visited_array = vl->mass;
+        vl_type tag = vl->curV;
 
         ResultHeap top_candidates;
         ResultHeap candidateSet;
+        ExactDistance dist{this, data_point};
+        // batch buffers come from the query pool, inserts run this many times
+        std::unique_ptr<SearchContext> ctx = acquireSearchContext();
+        ctx->batchIds.resize(std::max<size_t>(M, ctx->batchIds.size()));
+        ctx->batchDists.resize(ctx->batchIds.size());
+        tableint *batchIds = ctx->batchIds.data();
+        float *batchDists = ctx->batchDists.data();
 
         float lowerBound;
 
@@ -908,27 +2617,32 @@ private:
 
             for(int i = 0; i <= 0; i++) {
                 if(layer - i <= 0) break;
+                // other inserts rewrite lists meanwhile, the neighbors are gathered under the lock
+                std::unique_lock<std::mutex> lock(linkListLocks_[curNodeNum]);
                 int *data = (int *) get_linklist(curNodeNum, layer - i);
                 size_t size = getListCount((linklistsizeint *) data);
                 tableint *datal = (tableint *) (data + 1);
 
+                size_t num = 0;
                 for (size_t j = 0; j < size; j++) {
                     tableint candidate_id = *(datal + j);
 #ifdef USE_SSE
-                    _mm_prefetch((char *) (visited_array + *(datal + j + 1)), _MM_HINT_T0);
-                    _mm_prefetch(getDataByInternalId(*(datal + j + 1)), _MM_HINT_T0);
-                    _mm_prefetch((char *) (visited_array + *(datal + j + 2)), _MM_HINT_T0);
-                    _mm_prefetch(getDataByInternalId(*(datal + j + 2)), _MM_HINT_T0);
-                    // _mm_prefetch((char *) (visited_array + *(datal + j + 3)), _MM_HINT_T0);
-                    // _mm_prefetch(getDataByInternalId(*(datal + j + 3)), _MM_HINT_T0);
-                    // _mm_prefetch((char *) (visited_array + *(datal + j + 4)), _MM_HINT_T0);
-                    // _mm_prefetch(getDataByInternalId(*(datal + j + 4)), _MM_HINT_T0);
+                    if (j + 1 < size)
+                        _mm_prefetch((char *) (visited_array + *(datal + j + 1)), _MM_HINT_T0);
 #endif
                     if (visited_array[candidate_id] == tag) continue;
                     visited_array[candidate_id] = tag;
-                    char *currObj1 = (getDataByInternalId(candidate_id));
+#ifdef USE_SSE
+                    _mm_prefetch(getDataByInternalId(candidate_id), _MM_HINT_T0);
+#endif
+                    batchIds[num++] = candidate_id;
+                }
+                lock.unlock();
+                dist.batch(batchIds, num, batchDists);
 
-                    float dist1 = fstdistfunc_(data_point, currObj1, dist_func_param_);
+                for (size_t j = 0; j < num; j++) {
+                    tableint candidate_id = batchIds[j];
+                    float dist1 = batchDists[j];
                     if (top_candidates.size() < ef_construction || lowerBound > dist1) {
                         candidateSet.emplace(-dist1, candidate_id);
 #ifdef USE_SSE
@@ -946,44 +2660,56 @@ private:
                 }
             }
         }
+        visited_list_pool_->releaseVisitedList(vl);
+        releaseSearchContext(std::move(ctx));
 
         return top_candidates;
     }
 
-    ResultHeap
-    searchBaseLayer0(std::vector<tableint> ep_ids, const void *data_point, int Layer, int rangeL, int rangeR, int ef, int splitPoint) {
-        tag ++;
-
-        ResultHeap top_candidates;
-        ResultHeap candidateSet;
+    // fills ctx.results, farthest on top
+    template<typename RangeFilter, typename Visited, typename Distance>
+    void
+    searchBaseLayer0(SearchContext &ctx, const tableint *ep_ids, const short int *ep_layers, int ep_num,
+                     const Distance &dist, int Layer, const RangeFilter &inRange, Visited &visited,
+                     int ef, int splitPoint) const {
+
+        std::vector<std::pair<float, tableint>> &top_candidates = ctx.results;
+        std::vector<LayerCandidate> &candidateSet = ctx.candidates;
+        candidateSet.clear();
+        ctx.batchIds.resize(M);
+        ctx.batchDists.resize(M);
+        ctx.batchInside.resize(M);
+        tableint *batchIds = ctx.batchIds.data();
+        float *batchDists = ctx.batchDists.data();
+        char *batchInside = ctx.batchInside.data();
 
         float lowerBound;
-        for(int i = 0; i < ep_ids.size(); i++) {
+        for(int i = 0; i < ep_num; i++) {
             int ep_id = ep_ids[i];
-            float dist = fstdistfunc_(data_point, getDataByInternalId(ep_id), dist_func_param_);
-            if(!isDeleted[ep_id] && valueList_[ep_id]>=rangeL && valueList_[ep_id] <= rangeR) {
-                top_candidates.emplace(dist, ep_id);
-                candidateSet.emplace(-dist, ep_id);
+            float epDist = dist(ep_id);
+            if(!isDeleted[ep_id] && inRange(ep_id)) {
+                pushResult(top_candidates, epDist, ep_id);
+                pushCandidate(candidateSet, {-epDist, (tableint) ep_id, ep_layers[i]});
             }
             else{
-                candidateSet.emplace(-std::numeric_limits<float>::max(), ep_id);
+                pushCandidate(candidateSet, {-std::numeric_limits<float>::max(), (tableint) ep_id, ep_layers[i]});
             }
-            visited_array[ep_id] = tag;
+            visited.testAndSet(ep_id);
         }
 
         if(!top_candidates.empty())
-            lowerBound = top_candidates.top().first;
+            lowerBound = top_candidates.front().first;
         else
             lowerBound = std::numeric_limits<float>::max();
 
         while (!candidateSet.empty()) {
-            std::pair<float, tableint> curr_el_pair = candidateSet.top();
-            tableint curNodeNum = curr_el_pair.second;
-            short int layer = searchLayer[curNodeNum];
-            if ((-curr_el_pair.first) > lowerBound && top_candidates.size() == ef) {
+            LayerCandidate curr_el = candidateSet.front();
+            tableint curNodeNum = curr_el.id;
+            short int layer = curr_el.layer;
+            if ((-curr_el.dist) > lowerBound && top_candidates.size() == ef) {
                 break;
             }
-            candidateSet.pop();
+            popCandidate(candidateSet);
 
             for(int i = 0; i <= 1; i++) {
                 if(layer - i <= 0) break;
@@ -991,47 +2717,33 @@ private:
 
                 size_t size = getListCount((linklistsizeint *) data);
                 tableint *datal = (tableint *) (data + 1);
-#ifdef USE_SSE
-                _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
-                _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-                _mm_prefetch(getDataByInternalId(*datal), _MM_HINT_T0);
-                _mm_prefetch(getDataByInternalId(*(datal + 1)), _MM_HINT_T0);
-#endif
+                visited.prefetch(*(data + 1));
 
-                for (size_t j = 0; j < size; j++) {
-                    tableint candidate_id = *(datal + j);
-#ifdef USE_SSE
-                    // if(j%2 == 0){
-                        _mm_prefetch((char *) (visited_array + *(datal + j + 1)), _MM_HINT_T0);
-                        _mm_prefetch(getDataByInternalId(*(datal + j + 1)), _MM_HINT_T0);
-                        _mm_prefetch((char *) (visited_array + *(datal + j + 2)), _MM_HINT_T0);
-                        _mm_prefetch(getDataByInternalId(*(datal + j + 2)), _MM_HINT_T0);
-                    // }
-#endif
-                    if (visited_array[candidate_id] == tag) continue;
-                    // if ( !(valueList_[candidate_id] >= rangeL && valueList_[candidate_id] <= rangeR))continue;
-                    visited_array[candidate_id] = tag;
-                    char *currObj1 = (getDataByInternalId(candidate_id));
+                // gather the unvisited neighbors first and score them in one batch, the range
+                // test comes with them
+                size_t num = collectNeighbors<false>(datal, size, inRange.forLayer(layer - i), visited, dist,
+                                                     batchIds, batchInside);
+                dist.batch(batchIds, num, batchDists);
 
+                for (size_t j = 0; j < num; j++) {
+                    tableint candidate_id = batchIds[j];
                     tableint cid = candidate_id;
 
-                    float dist1 = fstdistfunc_(data_point, currObj1, dist_func_param_);
+                    float dist1 = batchDists[j];
                     if (top_candidates.size() < ef || lowerBound > dist1) {
-                        candidateSet.emplace(-dist1, cid);
-                        searchLayer[cid] = layer;
+                        pushCandidate(candidateSet, {-dist1, cid, layer});
 #ifdef USE_SSE
-                        _mm_prefetch(getDataByInternalId(candidateSet.top().second), _MM_HINT_T0);
+                        _mm_prefetch(dist.location(candidateSet.front().id), _MM_HINT_T0);
 #endif
 
-                        if(!isDeleted[candidate_id])
-                            if ( valueList_[candidate_id] >= rangeL && valueList_[candidate_id] <= rangeR)
-                                top_candidates.emplace(dist1, cid);
+                        if (batchInside[j] && !isDeleted[candidate_id] && inRange.confirm(candidate_id))
+                            pushResult(top_candidates, dist1, cid);
 
                         if (top_candidates.size() > ef)
-                            top_candidates.pop();
+                            popResult(top_candidates);
 
                         if (!top_candidates.empty())
-                            lowerBound = top_candidates.top().first;
+                            lowerBound = top_candidates.front().first;
                     }
                 }
             }
@@ -1042,58 +2754,56 @@ private:
 
                 size_t size = getListCount((linklistsizeint *) data);
                 tableint *datal = (tableint *) (data + 1);
-#ifdef USE_SSE
-                _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
-                _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-                _mm_prefetch(getDataByInternalId(*datal), _MM_HINT_T0);
-                _mm_prefetch(getDataByInternalId(*(datal + 1)), _MM_HINT_T0);
-#endif
+                visited.prefetch(*(data + 1));
 
-                for (size_t j = 0; j < size; j++) {
-                    tableint candidate_id = *(datal + j);
-#ifdef USE_SSE
-                    // if(j%2==0){
-                    _mm_prefetch((char *) (visited_array + *(datal + j + 1)), _MM_HINT_T0);
-                    _mm_prefetch(getDataByInternalId(*(datal + j + 1)), _MM_HINT_T0);
-                    _mm_prefetch((char *) (visited_array + *(datal + j + 2)), _MM_HINT_T0);
-                    _mm_prefetch(getDataByInternalId(*(datal + j + 2)), _MM_HINT_T0);
-                    // }
-#endif
-                    if (visited_array[candidate_id] == tag) continue;
-                    if ( !(valueList_[candidate_id] >= rangeL && valueList_[candidate_id] <= rangeR))continue;
-                    visited_array[candidate_id] = tag;
-                    char *currObj1 = (getDataByInternalId(candidate_id));
+                // only neighbors in the range are collected here
+                size_t num = collectNeighbors<true>(datal, size, inRange.forLayer(Layer), visited, dist,
+                                                    batchIds, batchInside);
+                dist.batch(batchIds, num, batchDists);
 
+                for (size_t j = 0; j < num; j++) {
+                    tableint candidate_id = batchIds[j];
                     tableint cid = candidate_id;
 
-                    float dist1 = fstdistfunc_(data_point, currObj1, dist_func_param_);
+                    float dist1 = batchDists[j];
                     if (top_candidates.size() < ef || lowerBound > dist1) {
-                        candidateSet.emplace(-dist1, cid);
-                        searchLayer[cid] = searchLayer[ep_ids[0]] == layer ? searchLayer[ep_ids[1]]: searchLayer[ep_ids[0]];
+                        pushCandidate(candidateSet, {-dist1, cid, ep_layers[0] == layer ? ep_layers[1] : ep_layers[0]});
 #ifdef USE_SSE
-                        _mm_prefetch(getDataByInternalId(candidateSet.top().second), _MM_HINT_T0);
+                        _mm_prefetch(dist.location(candidateSet.front().id), _MM_HINT_T0);
 #endif
 
-                        if ( valueList_[candidate_id] >= rangeL && valueList_[candidate_id] <= rangeR)
-                            top_candidates.emplace(dist1, cid);
+                        if (!isDeleted[candidate_id] && inRange.confirm(candidate_id))
+                            pushResult(top_candidates, dist1, cid);
 
                         if (top_candidates.size() > ef)
-                            top_candidates.pop();
+                            popResult(top_candidates);
 
                         if (!top_candidates.empty())
-                            lowerBound = top_candidates.top().first;
+                            lowerBound = top_candidates.front().first;
                     }
                 }
             }
         }
 
-        return top_candidates;
     }
 
+    // descent of the insert path, which reads the lists under their element locks
+    tableint
+    findEntry(const void *query_data, int endLayer, tableint currObj) const {
+        return descend(ExactDistance{this, query_data}, endLayer, currObj, true);
+    }
+
+    template<typename Distance>
+    tableint
+    findEntryBy(const Distance &dist, node *nd, tableint currObj) const {
+        return descend(dist, nd->layer, currObj, false);
+    }
+
+    // greedy descent from currObj through the layers below endLayer
+    template<typename Distance>
     tableint
-    findEntry(const void *query_data, node *nd, tableint currObj) const {
-        float curdist = fstdistfunc_(query_data, getDataByInternalId(currObj), dist_func_param_);
-        int endLayer = nd->layer;
+    descend(const Distance &dist, int endLayer, tableint currObj, bool locked) const {
+        float curdist = dist(currObj);
         int startLayer = findEntryLayer(endLayer);
 
         for (int layer = startLayer; layer < endLayer; layer += skipLayer) {
@@ -1103,6 +2813,8 @@ private:
                 unsigned int *data;
 
                 for(int l = 0; l <= 0 ; l++){
+                    std::unique_lock<std::mutex> lock;
+                    if(locked) lock = std::unique_lock<std::mutex>(linkListLocks_[currObj]);
                     data = (unsigned int *) get_linklist(currObj, layer-l);
                     int size = getListCount(data);
 
@@ -1110,10 +2822,10 @@ private:
                     for (int i = 0; i < size; i++) {
                         tableint cand = datal[i];
 #ifdef USE_SSE
-                        _mm_prefetch(getDataByInternalId(*(datal + i + 1)), _MM_HINT_T0);
-                        _mm_prefetch(getDataByInternalId(*(datal + i + 2)), _MM_HINT_T0);
+                        if (i + 1 < size) _mm_prefetch(dist.location(*(datal + i + 1)), _MM_HINT_T0);
+                        if (i + 2 < size) _mm_prefetch(dist.location(*(datal + i + 2)), _MM_HINT_T0);
 #endif
-                        float d = fstdistfunc_(query_data, getDataByInternalId(cand), dist_func_param_);
+                        float d = dist(cand);
 
                         if (d < curdist) {
                             curdist = d;
@@ -1128,17 +2840,75 @@ private:
     }
 
 
+    // Degree of the lists at each layer: the schedule entry capped by M, and by the size of
+    // a layer subtree, which holds at most (BTREE_M + 1)^layer elements while a node is split.
+    void initLayers(){
+        maxM_.assign(maxLayer + 1, 0);
+        sizeLinkList.assign(maxLayer + 1, 0);
+        size_t subtree = 1;
+        for(int l = 0; l <= maxLayer; l++){
+            // layer 0 lists stay empty, every other layer needs room for at least one neighbor
+            if(l >= 1 && l < (int) degreeSchedule_.size() && degreeSchedule_[l] < 1)
+                throw std::runtime_error("Degree schedule must be at least 1 from layer 1 on");
+            size_t degree = l < (int) degreeSchedule_.size() ? std::max(degreeSchedule_[l], 0) : M;
+            maxM_[l] = std::min({degree, (size_t) M, subtree - 1});
+            if(l > 0 && maxM_[l] < maxM_[l - 1])
+                throw std::runtime_error("Degree schedule must not decrease with the layer");
+            subtree = std::min(subtree * (BTREE_M + 1), (size_t) M + 1);
+            sizeLinkList[l] = linkListSize(maxM_[l]);
+        }
+    }
+
+    // count, maxM neighbor ids and, with inlineValues_, the maxM neighbor values
+    size_t linkListSize(size_t maxM) const {
+        return sizeof(linklistsizeint) + maxM * sizeof(tableint) + (inlineValues_ ? maxM * sizeof(int) : 0);
+    }
+
+    // one spare list keeps the neighbor prefetch lookahead of the last element inside the arena
+    size_t linkArenaSize(size_t eleNum, int layer) const {
+        return (eleNum + 1) * sizeLinkList[layer];
+    }
+
+    size_t linkSectionSize(int topLayer) const {
+        size_t size = 0;
+        for(int l = 0; l <= topLayer; l++) size += eleCount * sizeLinkList[l];
+        return size;
+    }
+
     linklistsizeint *get_linklist(tableint internal_id, int layer) const {
-        return (linklistsizeint *) (linklist[internal_id] + sizeLinkList * layer);
+        return (linklistsizeint *) (linkLayers_[layer] + (size_t) internal_id * sizeLinkList[layer]);
+    }
+
+    // a new root starts with the lists of the old one, which inserts still being linked may
+    // be rewriting
+    void copyLayer(int from, int to){
+        for(size_t i = 0; i < eleCount; i++){
+            std::lock_guard<std::mutex> lock(linkListLocks_[i]);
+            linklistsizeint *src = get_linklist(i, from), *dst = get_linklist(i, to);
+            size_t size = getListCount(src);
+            memcpy(dst, src, sizeof(linklistsizeint) + size * sizeof(tableint));
+            commitList(dst, size, to);
+        }
     }
 
 
     unsigned short int getListCount(linklistsizeint * ptr) const {
-        return *((unsigned short int *)ptr);
+        return __atomic_load_n((unsigned short int *) ptr, __ATOMIC_ACQUIRE);
     }
 
     void setListCount(linklistsizeint * ptr, unsigned short int size) const {
-        *((unsigned short int*)(ptr))=*((unsigned short int *)&size);
+        __atomic_store_n((unsigned short int *) ptr, size, __ATOMIC_RELEASE);
+    }
+
+    // copies the values of a list whose ids are written next to them, then sets its count, so
+    // that a reader sees the ids and values of every entry the count covers
+    void commitList(linklistsizeint *ptr, unsigned short int size, int layer) const {
+        if(inlineValues_){
+            tableint *datal = (tableint *) (ptr + 1);
+            int *values = (int *) (datal + maxM_[layer]);
+            for(size_t j = 0; j < size; j++) values[j] = valueList_[datal[j]];
+        }
+        setListCount(ptr, size);
     }
 };
 
@@ -18,19 +18,18 @@ using namespace std;
 using namespace std::chrono;
 
 int main(int argc, char** argv) {
-    if (argc != 7) {
+    if (argc != 7 && argc != 8) {
         cerr << "Usage: " << argv[0] << " <data.fvecs> <attributes.data> "
-             << "<dim> <M> <ef_construction> <threads>\n";
+             << "<dim> <M> <ef_construction> <threads> [index_path]\n";
         cerr << "\n";
         cerr << "Arguments:\n";
-        cerr << "  data.fvecs         - Database vectors in .fvecs format\n";
-        cerr << "  attributes.data    - Attribute file in 'key value' format\n";
+        cerr << "  data.fvecs         - Database vectors (.fvecs, .bvecs, .fbin or .u8bin)\n";
+        cerr << "  attributes.data    - Attribute file, binary (csv_to_data) or 'key value' text\n";
         cerr << "  dim                - Vector dimension\n";
         cerr << "  M                  - HNSW degree parameter (max links per layer)\n";
         cerr << "  ef_construction    - Construction ef parameter\n";
         cerr << "  threads            - Number of threads for index construction\n";
-        cerr << "\n";
-        cerr << "Note: Index path is not used (DIGRA doesn't support serialization)\n";
+        cerr << "  index_path         - Optional file the built index is saved to\n";
         return 1;
     }
 
@@ -40,6 +39,7 @@ int main(int argc, char** argv) {
     int M = stoi(argv[4]);
     int ef_construction = stoi(argv[5]);
     int threads = stoi(argv[6]);
+    string index_path = argc == 8 ? argv[7] : "";
 
     // Set number of threads for construction
     omp_set_num_threads(threads);
@@ -56,97 +56,48 @@ int main(int argc, char** argv) {
     cout << "DEBUG: Starting data loading phase" << endl;
     cout << "========================================" << endl;
     
-    // Load vectors using DIGRA's load_data function
-    // Note: load_data takes num/dim by VALUE (not reference), so we need to calculate count ourselves
+    // Load vectors, the count and dimension come from the file
     float* data = nullptr;
-    
-    // First, manually read the file to get the actual vector count
-    cout << "DEBUG: Opening data file: " << data_fvecs << endl;
-    ifstream data_file(data_fvecs, ios::binary);
-    if (!data_file.is_open()) {
-        cerr << "ERROR: Cannot open data file: " << data_fvecs << endl;
+    size_t num = 0;
+    int file_dim = 0;
+    cout << "DEBUG: Loading data file: " << data_fvecs << endl;
+    if (!load_vectors(data_fvecs.c_str(), data, num, file_dim)) {
+        cerr << "ERROR: Cannot load data file: " << data_fvecs << endl;
         return 1;
     }
-    cout << "DEBUG: Data file opened successfully" << endl;
-    
-    // Read dimension from first vector
-    int file_dim;
-    data_file.read((char*)&file_dim, 4);
+    int baseNum = num;
     cout << "DEBUG: Read dimension from file: " << file_dim << endl;
     cout << "DEBUG: Expected dimension (from args): " << dim << endl;
-    
+
     if (file_dim != dim) {
         cerr << "ERROR: Dimension mismatch. Expected " << dim << ", got " << file_dim << endl;
-        data_file.close();
+        delete[] data;
         return 1;
     }
     cout << "DEBUG: Dimension validation PASSED" << endl;
-    
-    // Calculate number of vectors from file size
-    data_file.seekg(0, ios::end);
-    size_t fsize = data_file.tellg();
-    cout << "DEBUG: File size in bytes: " << fsize << endl;
-    cout << "DEBUG: Calculation: fsize=" << fsize << " / (file_dim + 1)=" << (file_dim + 1) << " / 4" << endl;
-    int baseNum = (unsigned)(fsize / (file_dim + 1) / 4);
-    cout << "DEBUG: Calculated baseNum: " << baseNum << endl;
-    data_file.close();
-    
-    // Now call load_data to actually allocate and read the data
-    cout << "DEBUG: Calling load_data() to allocate and read vectors..." << endl;
-    cout << "DEBUG: data pointer before load_data: " << (void*)data << endl;
-    
-    int dummy_num = 0;
-    int dummy_dim = 0;
-    load_data(data_fvecs.c_str(), data, dummy_num, dummy_dim);
-    
-    cout << "DEBUG: load_data() completed" << endl;
-    cout << "DEBUG: data pointer after load_data: " << (void*)data << endl;
-    
-    if (data == nullptr) {
-        cerr << "ERROR: load_data() returned null pointer!" << endl;
-        return 1;
-    }
-    cout << "DEBUG: Data pointer is valid (not null)" << endl;
     cout << "DEBUG: Successfully loaded " << baseNum << " vectors of dimension " << file_dim << endl;
 
     // Load attributes from .data file
     cout << "\n========================================" << endl;
     cout << "DEBUG: Starting attribute loading phase" << endl;
     cout << "========================================" << endl;
-    cout << "DEBUG: Allocating arrays for keys and values (size=" << baseNum << ")" << endl;
-    
-    int* keys = new int[baseNum];
-    int* values = new int[baseNum];
-    cout << "DEBUG: Allocated keys at: " << (void*)keys << endl;
-    cout << "DEBUG: Allocated values at: " << (void*)values << endl;
-    
-    cout << "DEBUG: Opening attribute file: " << attr_data << endl;
-    ifstream attr_file(attr_data);
-    if (!attr_file.is_open()) {
-        cerr << "ERROR: Cannot open attribute file: " << attr_data << endl;
+    cout << "DEBUG: Loading attribute file: " << attr_data << endl;
+    int* keys = nullptr;
+    int* values = nullptr;
+    size_t attrNum = 0;
+    if (!load_attributes(attr_data.c_str(), keys, values, attrNum)) {
+        cerr << "ERROR: Cannot load attribute file: " << attr_data << endl;
         delete[] data;
         return 1;
     }
-    cout << "DEBUG: Attribute file opened successfully" << endl;
-    
-    int count = 0;
-    cout << "DEBUG: Reading attribute key-value pairs..." << endl;
-    while (attr_file >> keys[count] >> values[count]) {
-        if (count < 3 || count >= baseNum - 3) {
-            cout << "DEBUG: Attribute[" << count << "]: key=" << keys[count] << ", value=" << values[count] << endl;
-        } else if (count == 3) {
+    int count = attrNum;
+    for (int i = 0; i < count; i++) {
+        if (i < 3 || i >= count - 3) {
+            cout << "DEBUG: Attribute[" << i << "]: key=" << keys[i] << ", value=" << values[i] << endl;
+        } else if (i == 3) {
             cout << "DEBUG: ... (showing first 3 and last 3 only) ..." << endl;
         }
-        count++;
-        if (count > baseNum) {
-            cerr << "ERROR: More attributes than vectors (read " << count << ", expected " << baseNum << ")" << endl;
-            delete[] data;
-            delete[] keys;
-            delete[] values;
-            return 1;
-        }
     }
-    attr_file.close();
     cout << "DEBUG: Read " << count << " attribute pairs" << endl;
     
     if (count != baseNum) {
@@ -232,6 +183,21 @@ int main(int argc, char** argv) {
     // Memory footprint
     peak_memory_footprint();
 
+    // ========== INDEX SERIALIZATION (NOT TIMED) ==========
+    if (!index_path.empty()) {
+        try {
+            rangeHnsw->saveIndex(index_path);
+            cout << "Index saved to: " << index_path << endl;
+        } catch (const exception& e) {
+            cerr << "ERROR: Failed to save index: " << e.what() << endl;
+            delete[] data;
+            delete[] keys;
+            delete[] values;
+            delete rangeHnsw;
+            return 1;
+        }
+    }
+
     // Cleanup
     delete[] data;
     delete[] keys;
@@ -240,8 +206,5 @@ int main(int argc, char** argv) {
         delete rangeHnsw;
     }
 
-    cout << "\nNote: DIGRA does not support index serialization." << endl;
-    cout << "Index must be rebuilt for query phase." << endl;
-
     return 0;
 }
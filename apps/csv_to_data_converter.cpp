@@ -1,6 +1,7 @@
 // csv_to_data_converter.cpp - Convert FANNS .csv attributes to DIGRA .data format
-// This converter reads a CSV file with a header line and converts it to DIGRA's
-// simple "key value" text format where key is the 0-indexed position
+// This converter reads a CSV file with a header line and writes DIGRA's binary
+// attribute file (see utils.hpp), or with --text the "key value" text format,
+// where key is the 0-indexed position
 
 #include <iostream>
 #include <fstream>
@@ -8,15 +9,19 @@
 #include <sstream>
 #include <vector>
 
+#include "../utils.hpp"
+
 using namespace std;
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        cerr << "Usage: " << argv[0] << " <input.csv> <output.data>\n";
+    bool text = argc == 4 && string(argv[3]) == "--text";
+    if (argc != 3 && !text) {
+        cerr << "Usage: " << argv[0] << " <input.csv> <output.data> [--text]\n";
         cerr << "\n";
         cerr << "Converts FANNS .csv attribute file (with header) to DIGRA .data format\n";
         cerr << "Input CSV format: header line + one integer value per line\n";
-        cerr << "Output .data format: 'key value' pairs (0-indexed keys)\n";
+        cerr << "Output .data format: int32 key and value columns (0-indexed keys),\n";
+        cerr << "or 'key value' pairs with --text\n";
         return 1;
     }
 
@@ -71,7 +76,19 @@ int main(int argc, char** argv) {
     
     cout << "Read " << values.size() << " attribute values from " << input_csv << endl;
 
-    // Write output file in .data format
+    if (!text) {
+        vector<int> keys(values.size());
+        for (size_t i = 0; i < keys.size(); i++) keys[i] = i;
+        if (!save_attributes(output_data.c_str(), keys.data(), values.data(), values.size())) {
+            cerr << "Error: Cannot write output file: " << output_data << endl;
+            return 1;
+        }
+        cout << "Wrote " << values.size() << " key-value pairs to " << output_data << endl;
+        cout << "Conversion complete!" << endl;
+        return 0;
+    }
+
+    // Write output file in text .data format
     ofstream outfile(output_data);
     if (!outfile.is_open()) {
         cerr << "Error: Cannot open output file: " << output_data << endl;
@@ -48,9 +48,9 @@ int main(int argc, char** argv) {
              << "<dim> <M> <ef_construction> <ef_search_list> <k> <threads>\n";
         cerr << "\n";
         cerr << "Arguments:\n";
-        cerr << "  data.fvecs          - Database vectors in .fvecs format\n";
-        cerr << "  attributes.data     - Attribute file in 'key value' format\n";
-        cerr << "  query.fvecs         - Query vectors in .fvecs format\n";
+        cerr << "  data.fvecs          - Database vectors (.fvecs, .bvecs, .fbin or .u8bin)\n";
+        cerr << "  attributes.data     - Attribute file, binary (csv_to_data) or 'key value' text\n";
+        cerr << "  query.fvecs         - Query vectors (.fvecs, .bvecs, .fbin or .u8bin)\n";
         cerr << "  query_ranges.csv    - Query ranges (low-high per line)\n";
         cerr << "  groundtruth.ivecs   - Groundtruth in .ivecs format\n";
         cerr << "  dim                 - Vector dimension\n";
@@ -76,16 +76,9 @@ int main(int argc, char** argv) {
     int threads = stoi(argv[11]);
 
     // Set number of threads for construction
-    // NOTE: DIGRA's index construction (buildTree() in TreeHNSW.hpp) is INHERENTLY SEQUENTIAL.
-    // The buildTree function uses std::queue-based level-by-level tree construction with no
-    // OpenMP parallel directives (#pragma omp parallel). Setting omp_set_num_threads() here
-    // has NO EFFECT on index construction because the code doesn't use OpenMP for parallelism.
-    // 
-    // This is a fundamental limitation of the DIGRA algorithm implementation, not a configuration
-    // issue. The tree structure is built sequentially by design.
-    //
-    // Query execution also appears to be single-threaded in this implementation.
-    omp_set_num_threads(threads);  // Note: Ineffective for DIGRA's sequential buildTree()
+    // buildTree() links the elements of each tree layer in parallel with OpenMP,
+    // so construction scales with this setting.
+    omp_set_num_threads(threads);
     
     cout << "=== DIGRA Index Construction and Query Execution ===" << endl;
     cout << "Data: " << data_fvecs << endl;
@@ -97,96 +90,56 @@ int main(int argc, char** argv) {
     cout << "ef_search values: ";
     for (int ef : ef_search_list) cout << ef << " ";
     cout << endl;
-    cout << "Threads: " << threads << " (Note: DIGRA's index construction is inherently sequential)" << endl;
+    cout << "Threads: " << threads << endl;
 
     // ========== DATA LOADING (NOT TIMED) ==========
     cout << "\nLoading data..." << endl;
     
     // Load database vectors
     float* data = nullptr;
-    
-    // Calculate database vector count from file
-    ifstream data_file(data_fvecs, ios::binary);
-    if (!data_file.is_open()) {
-        cerr << "ERROR: Cannot open data file: " << data_fvecs << endl;
+    size_t num = 0;
+    int file_dim = 0;
+    if (!load_vectors(data_fvecs.c_str(), data, num, file_dim)) {
+        cerr << "ERROR: Cannot load data file: " << data_fvecs << endl;
         return 1;
     }
-    
-    int file_dim;
-    data_file.read((char*)&file_dim, 4);
-    
+    int baseNum = num;
+
     if (file_dim != dim) {
         cerr << "ERROR: Dimension mismatch. Expected " << dim << ", got " << file_dim << endl;
-        data_file.close();
-        return 1;
-    }
-    
-    data_file.seekg(0, ios::end);
-    size_t data_fsize = data_file.tellg();
-    int baseNum = (unsigned)(data_fsize / (file_dim + 1) / 4);
-    data_file.close();
-    
-    // Load data using DIGRA's function
-    int dummy_num = 0, dummy_dim = 0;
-    load_data(data_fvecs.c_str(), data, dummy_num, dummy_dim);
-    
-    if (data == nullptr) {
-        cerr << "ERROR: load_data() returned null pointer for database!" << endl;
+        delete[] data;
         return 1;
     }
     cout << "Loaded " << baseNum << " database vectors of dimension " << dim << endl;
 
     // Load query vectors
     float* query = nullptr;
-    
-    ifstream query_file(query_fvecs, ios::binary);
-    if (!query_file.is_open()) {
-        cerr << "ERROR: Cannot open query file: " << query_fvecs << endl;
+    if (!load_vectors(query_fvecs.c_str(), query, num, file_dim)) {
+        cerr << "ERROR: Cannot load query file: " << query_fvecs << endl;
         delete[] data;
         return 1;
     }
-    
-    query_file.read((char*)&file_dim, 4);
-    
+    int queryNum = num;
+
     if (file_dim != dim) {
         cerr << "ERROR: Dimension mismatch in queries. Expected " << dim << ", got " << file_dim << endl;
-        query_file.close();
-        delete[] data;
-        return 1;
-    }
-    
-    query_file.seekg(0, ios::end);
-    size_t query_fsize = query_file.tellg();
-    int queryNum = (unsigned)(query_fsize / (file_dim + 1) / 4);
-    query_file.close();
-    
-    load_data(query_fvecs.c_str(), query, dummy_num, dummy_dim);
-    
-    if (query == nullptr) {
-        cerr << "ERROR: load_data() returned null pointer for queries!" << endl;
         delete[] data;
+        delete[] query;
         return 1;
     }
     cout << "Loaded " << queryNum << " query vectors" << endl;
 
     // Load attributes
-    int* keys = new int[baseNum];
-    int* values = new int[baseNum];
-    
-    ifstream attr_file(attr_data);
-    if (!attr_file.is_open()) {
-        cerr << "ERROR: Cannot open attribute file: " << attr_data << endl;
+    int* keys = nullptr;
+    int* values = nullptr;
+    size_t attrNum = 0;
+    if (!load_attributes(attr_data.c_str(), keys, values, attrNum)) {
+        cerr << "ERROR: Cannot load attribute file: " << attr_data << endl;
         delete[] data;
         delete[] query;
         return 1;
     }
-    
-    int count = 0;
-    while (attr_file >> keys[count] >> values[count]) {
-        count++;
-        if (count > baseNum) break;
-    }
-    attr_file.close();
+    int count = attrNum;
     
     if (count != baseNum) {
         cerr << "ERROR: Mismatch between data size (" << baseNum 
@@ -305,25 +258,13 @@ int main(int argc, char** argv) {
     vector<double> qps_list;
 
     for (int ef_search : ef_search_list) {
-        vector<vector<int>> query_results(queryNum);
+        vector<int> query_results((size_t)queryNum * k);
         
         auto start_query = high_resolution_clock::now();
 
         // Execute queries
-        for (int i = 0; i < queryNum; i++) {
-            int rangeL = query_ranges[i].first;
-            int rangeR = query_ranges[i].second;
-            
-            // Perform range-filtered query
-            auto result = rangeHnsw->queryRange(query + i * dim, rangeL, rangeR, k, ef_search);
-            
-            // Extract IDs from priority queue
-            query_results[i].reserve(k);
-            while (!result.empty()) {
-                query_results[i].push_back(result.top().second);
-                result.pop();
-            }
-        }
+        rangeHnsw->queryRangeBatch(query, query_ranges.data(), queryNum, k, ef_search,
+                                   query_results.data(), nullptr);
 
         auto end_query = high_resolution_clock::now();
         
@@ -334,7 +275,9 @@ int main(int argc, char** argv) {
         // Compute recall
         int total_true_positives = 0;
         for (int i = 0; i < queryNum; i++) {
-            set<int> result_set(query_results[i].begin(), query_results[i].end());
+            // rows are padded with -1 after the last hit, the padding must not match a padded groundtruth row
+            auto row = query_results.begin() + (size_t)i * k;
+            set<int> result_set(row, find(row, row + k, -1));
             
             int gt_size = min(k, (int)groundtruth[i].size());
             for (int j = 0; j < gt_size; j++) {
@@ -7,6 +7,7 @@
 #include <string>
 #include <queue>
 #include <set>
+#include <algorithm>
 #include <chrono>
 #include <thread>
 #include <atomic>
@@ -20,27 +21,28 @@ using namespace std;
 using namespace std::chrono;
 
 int main(int argc, char** argv) {
-    if (argc != 19) {
+    if (argc != 19 && argc != 21) {
         cerr << "Usage: " << argv[0] << " --data_path <data.fvecs> "
              << "--query_path <query.fvecs> --query_ranges_file <ranges.csv> "
              << "--groundtruth_file <gt.ivecs> --attributes_file <attrs.data> "
-             << "--dim <dim> --ef_search <ef> --k <k> --M <M>\n";
+             << "--dim <dim> --ef_search <ef> --k <k> --M <M> [--index_path <index>]\n";
         cerr << "\n";
         cerr << "Arguments:\n";
-        cerr << "  --data_path          - Database vectors in .fvecs format\n";
-        cerr << "  --query_path         - Query vectors in .fvecs format\n";
+        cerr << "  --data_path          - Database vectors (.fvecs, .bvecs, .fbin or .u8bin)\n";
+        cerr << "  --query_path         - Query vectors (.fvecs, .bvecs, .fbin or .u8bin)\n";
         cerr << "  --query_ranges_file  - Query ranges (low-high per line)\n";
         cerr << "  --groundtruth_file   - Groundtruth in .ivecs format\n";
-        cerr << "  --attributes_file    - Attributes in 'key value' format\n";
+        cerr << "  --attributes_file    - Attributes, binary (csv_to_data) or 'key value' text\n";
         cerr << "  --dim                - Vector dimension\n";
         cerr << "  --ef_search          - Search ef parameter\n";
         cerr << "  --k                  - Number of neighbors to return\n";
         cerr << "  --M                  - HNSW degree (used for rebuild)\n";
+        cerr << "  --index_path         - Optional index saved by build_wrapper, mapped read-only instead of rebuilding\n";
         return 1;
     }
 
     // Parse command-line arguments
-    string data_path, query_path, query_ranges_file, groundtruth_file, attributes_file;
+    string data_path, query_path, query_ranges_file, groundtruth_file, attributes_file, index_path;
     int dim = -1, ef_search = -1, k = -1, M = -1;
 
     for (int i = 1; i < argc; i += 2) {
@@ -54,6 +56,7 @@ int main(int argc, char** argv) {
         else if (arg == "--ef_search") ef_search = stoi(argv[i + 1]);
         else if (arg == "--k") k = stoi(argv[i + 1]);
         else if (arg == "--M") M = stoi(argv[i + 1]);
+        else if (arg == "--index_path") index_path = argv[i + 1];
     }
 
     // Validate inputs
@@ -81,89 +84,47 @@ int main(int argc, char** argv) {
 
     // ========== DATA LOADING (NOT TIMED) ==========
     float* data = nullptr;
-    
-    // Calculate database vector count from file
-    ifstream data_file(data_path, ios::binary);
-    if (!data_file.is_open()) {
-        cerr << "ERROR: Cannot open data file: " << data_path << endl;
+    size_t num = 0;
+    int file_dim = 0;
+    if (!load_vectors(data_path.c_str(), data, num, file_dim)) {
+        cerr << "ERROR: Cannot load data file: " << data_path << endl;
         return 1;
     }
-    
-    int file_dim;
-    data_file.read((char*)&file_dim, 4);
-    
+    int baseNum = num;
+
     if (file_dim != dim) {
         cerr << "ERROR: Dimension mismatch in data. Expected " << dim << ", got " << file_dim << endl;
-        data_file.close();
-        return 1;
-    }
-    
-    data_file.seekg(0, ios::end);
-    size_t data_fsize = data_file.tellg();
-    int baseNum = (unsigned)(data_fsize / (file_dim + 1) / 4);
-    data_file.close();
-    
-    // Load data using DIGRA's function
-    int dummy_num = 0, dummy_dim = 0;
-    load_data(data_path.c_str(), data, dummy_num, dummy_dim);
-    
-    if (data == nullptr) {
-        cerr << "ERROR: load_data() returned null pointer for database!" << endl;
+        delete[] data;
         return 1;
     }
 
     // Load query vectors
     float* query = nullptr;
-    
-    // Calculate query vector count from file
-    ifstream query_file(query_path, ios::binary);
-    if (!query_file.is_open()) {
-        cerr << "ERROR: Cannot open query file: " << query_path << endl;
+    if (!load_vectors(query_path.c_str(), query, num, file_dim)) {
+        cerr << "ERROR: Cannot load query file: " << query_path << endl;
         delete[] data;
         return 1;
     }
-    
-    query_file.read((char*)&file_dim, 4);
-    
+    int queryNum = num;
+
     if (file_dim != dim) {
         cerr << "ERROR: Dimension mismatch in queries. Expected " << dim << ", got " << file_dim << endl;
-        query_file.close();
-        delete[] data;
-        return 1;
-    }
-    
-    query_file.seekg(0, ios::end);
-    size_t query_fsize = query_file.tellg();
-    int queryNum = (unsigned)(query_fsize / (file_dim + 1) / 4);
-    query_file.close();
-    
-    // Load queries using DIGRA's function
-    load_data(query_path.c_str(), query, dummy_num, dummy_dim);
-    
-    if (query == nullptr) {
-        cerr << "ERROR: load_data() returned null pointer for queries!" << endl;
         delete[] data;
+        delete[] query;
         return 1;
     }
 
     // Load attributes
-    int* keys = new int[baseNum];
-    int* values = new int[baseNum];
-    
-    ifstream attr_file(attributes_file);
-    if (!attr_file.is_open()) {
-        cerr << "Error: Cannot open attribute file: " << attributes_file << endl;
+    int* keys = nullptr;
+    int* values = nullptr;
+    size_t attrNum = 0;
+    if (!load_attributes(attributes_file.c_str(), keys, values, attrNum)) {
+        cerr << "Error: Cannot load attribute file: " << attributes_file << endl;
         delete[] data;
         delete[] query;
         return 1;
     }
-    
-    int count = 0;
-    while (attr_file >> keys[count] >> values[count]) {
-        count++;
-        if (count > baseNum) break;
-    }
-    attr_file.close();
+    int count = attrNum;
     
     if (count != baseNum) {
         cerr << "Error: Attribute count mismatch" << endl;
@@ -221,13 +182,18 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    // ========== INDEX RECONSTRUCTION (NOT TIMED) ==========
-    // Note: ef_construction is not provided, using a reasonable default
+    // ========== INDEX LOADING / RECONSTRUCTION (NOT TIMED) ==========
+    // Note: ef_construction is not provided, using a reasonable default for the rebuild
     int ef_construction = max(200, ef_search * 2);
     
     RangeHNSW* rangeHnsw = nullptr;
     try {
-        rangeHnsw = new RangeHNSW(dim, baseNum, baseNum, data, keys, values, M, ef_construction);
+        if (!index_path.empty()) {
+            rangeHnsw = new RangeHNSW(index_path, 0, true);
+            cout << "Loaded index from: " << index_path << endl;
+        } else {
+            rangeHnsw = new RangeHNSW(dim, baseNum, baseNum, data, keys, values, M, ef_construction);
+        }
     } catch (const exception& e) {
         cerr << "ERROR: Exception during index reconstruction: " << e.what() << endl;
         delete[] data;
@@ -247,36 +213,18 @@ int main(int argc, char** argv) {
     // ========== QUERY EXECUTION (TIMED, excludes recall computation) ==========
     cout << "\n--- Starting query execution (TIMED) ---" << endl;
 
-    // NOTE: DIGRA's queryRange() is single-threaded by design (no OpenMP in query code)
-    // We don't need thread monitoring - just record that we're using 1 thread
+    // Queries run through queryRangeBatch() on the OpenMP thread count set above (1 thread)
     peak_threads.store(1);
 
-    // Store results for later recall calculation (NOT TIMED)
-    vector<vector<int>> query_results(queryNum);
+    // Results are written to a flat queryNum x k buffer; recall is computed afterwards (NOT TIMED)
+    vector<int> query_results((size_t)queryNum * k);
 
     auto start_time = high_resolution_clock::now();
 
     // Execute queries
     try {
-        for (int i = 0; i < queryNum; i++) {
-            int rangeL = query_ranges[i].first;
-            int rangeR = query_ranges[i].second;
-            
-            // Perform range-filtered query
-            // queryRange signature: queryRange(vecData, rangeL, rangeR, k, ef_s)
-            auto result = rangeHnsw->queryRange(query + i * dim, rangeL, rangeR, k, ef_search);
-            
-            // Extract IDs from priority queue
-            query_results[i].reserve(k);
-            while (!result.empty()) {
-                query_results[i].push_back(result.top().second);
-                result.pop();
-            }
-            
-            if ((i + 1) % 1000 == 0) {
-                cout << "  Processed " << (i + 1) << " / " << queryNum << " queries" << endl;
-            }
-        }
+        rangeHnsw->queryRangeBatch(query, query_ranges.data(), queryNum, k, ef_search,
+                                   query_results.data(), nullptr);
     } catch (const exception& e) {
         cerr << "Error during query execution: " << e.what() << endl;
         delete[] data;
@@ -307,7 +255,9 @@ int main(int argc, char** argv) {
     int total_true_positives = 0;
     for (int i = 0; i < queryNum; i++) {
         // Convert query results to set for faster lookup
-        set<int> result_set(query_results[i].begin(), query_results[i].end());
+        // rows are padded with -1 after the last hit, the padding must not match a padded groundtruth row
+        auto row = query_results.begin() + (size_t)i * k;
+        set<int> result_set(row, find(row, row + k, -1));
         
         // Count true positives (compare with first k groundtruth results)
         int gt_size = min(k, (int)groundtruth[i].size());
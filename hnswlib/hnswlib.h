@@ -20,6 +20,30 @@
 #endif
 #endif
 
+// With GCC and Clang the AVX, AVX2/FMA and AVX-512 kernels are compiled through target
+// attributes whatever -march says, and the spaces pick the widest one the CPU supports
+// at runtime. Define NO_RUNTIME_DISPATCH to only build the kernels enabled by -march.
+#if defined(USE_SSE) && defined(__GNUC__) && !defined(NO_RUNTIME_DISPATCH)
+#define USE_RUNTIME_DISPATCH
+#ifndef USE_AVX
+#define USE_AVX
+#endif
+#define USE_AVX2
+#ifndef USE_AVX512
+#define USE_AVX512
+#endif
+#define HNSWLIB_TARGET_AVX __attribute__((target("avx")))
+#define HNSWLIB_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define HNSWLIB_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#if defined(USE_AVX) && defined(__AVX2__) && defined(__FMA__)
+#define USE_AVX2
+#endif
+#define HNSWLIB_TARGET_AVX
+#define HNSWLIB_TARGET_AVX2
+#define HNSWLIB_TARGET_AVX512
+#endif
+
 #if defined(USE_AVX) || defined(USE_SSE)
 #ifdef _MSC_VER
 #include <intrin.h>
@@ -44,7 +68,7 @@ static uint64_t xgetbv(unsigned int index) {
 }
 #endif
 
-#if defined(USE_AVX512)
+#if defined(USE_AVX) || defined(USE_AVX512)
 #include <immintrin.h>
 #endif
 
@@ -86,6 +110,26 @@ static bool AVXCapable() {
     return HW_AVX && avxSupported;
 }
 
+static bool AVX2Capable() {
+    if (!AVXCapable()) return false;
+
+    int cpuInfo[4];
+
+    // CPU support
+    cpuid(cpuInfo, 0, 0);
+    int nIds = cpuInfo[0];
+
+    bool HW_AVX2 = false;
+    if (nIds >= 0x00000007) {  //  AVX2
+        cpuid(cpuInfo, 0x00000007, 0);
+        HW_AVX2 = (cpuInfo[1] & ((int)1 << 5)) != 0;
+    }
+
+    cpuid(cpuInfo, 1, 0);
+    bool HW_FMA = (cpuInfo[2] & ((int)1 << 12)) != 0;
+    return HW_AVX2 && HW_FMA;
+}
+
 static bool AVX512Capable() {
     if (!AVXCapable()) return false;
 
@@ -118,6 +162,7 @@ static bool AVX512Capable() {
 
 #include <queue>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <string.h>
 
@@ -170,6 +215,10 @@ static void readBinaryPOD(std::istream &in, T &podRef) {
 template<typename MTYPE>
 using DISTFUNC = MTYPE(*)(const void *, const void *, const void *);
 
+// one query against n rows: out[i] = dist(query, rows[i])
+template<typename MTYPE>
+using DISTFUNC_BATCH = void(*)(const void *, const void *const *, size_t, const void *, MTYPE *);
+
 template<typename MTYPE>
 class SpaceInterface {
  public:
@@ -180,6 +229,11 @@ class SpaceInterface {
 
     virtual void *get_dist_func_param() = 0;
 
+    // nullptr when the space has no batched kernel for this CPU
+    virtual DISTFUNC_BATCH<MTYPE> get_dist_func_batch() {
+        return nullptr;
+    }
+
     virtual ~SpaceInterface() {}
 };
 
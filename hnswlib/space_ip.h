@@ -21,7 +21,7 @@ InnerProductDistance(const void *pVect1, const void *pVect2, const void *qty_ptr
 #if defined(USE_AVX)
 
 // Favor using AVX if available.
-static float
+HNSWLIB_TARGET_AVX static float
 InnerProductSIMD4ExtAVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
     float PORTABLE_ALIGN32 TmpRes[8];
     float *pVect1 = (float *) pVect1v;
@@ -143,7 +143,7 @@ InnerProductDistanceSIMD4ExtSSE(const void *pVect1v, const void *pVect2v, const
 
 #if defined(USE_AVX512)
 
-static float
+HNSWLIB_TARGET_AVX512 static float
 InnerProductSIMD16ExtAVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
     float PORTABLE_ALIGN64 TmpRes[16];
     float *pVect1 = (float *) pVect1v;
@@ -207,7 +207,7 @@ InnerProductDistanceSIMD16ExtAVX512(const void *pVect1v, const void *pVect2v, co
 
 #if defined(USE_AVX)
 
-static float
+HNSWLIB_TARGET_AVX static float
 InnerProductSIMD16ExtAVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
     float PORTABLE_ALIGN32 TmpRes[8];
     float *pVect1 = (float *) pVect1v;
@@ -250,6 +250,43 @@ InnerProductDistanceSIMD16ExtAVX(const void *pVect1v, const void *pVect2v, const
 
 #endif
 
+#if defined(USE_AVX2)
+
+// AVX with fused multiply-add, two accumulators to hide the FMA latency.
+HNSWLIB_TARGET_AVX2 static float
+InnerProductSIMD16ExtAVX2(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    float PORTABLE_ALIGN32 TmpRes[8];
+    float *pVect1 = (float *) pVect1v;
+    float *pVect2 = (float *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    size_t qty16 = qty / 16;
+
+    const float *pEnd1 = pVect1 + 16 * qty16;
+
+    __m256 sum0 = _mm256_set1_ps(0);
+    __m256 sum1 = _mm256_set1_ps(0);
+
+    while (pVect1 < pEnd1) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(pVect1), _mm256_loadu_ps(pVect2), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(pVect1 + 8), _mm256_loadu_ps(pVect2 + 8), sum1);
+        pVect1 += 16;
+        pVect2 += 16;
+    }
+
+    _mm256_store_ps(TmpRes, _mm256_add_ps(sum0, sum1));
+    float sum = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+
+    return sum;
+}
+
+static float
+InnerProductDistanceSIMD16ExtAVX2(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    return 1.0f - InnerProductSIMD16ExtAVX2(pVect1v, pVect2v, qty_ptr);
+}
+
+#endif
+
 #if defined(USE_SSE)
 
 static float
@@ -304,12 +341,133 @@ InnerProductDistanceSIMD16ExtSSE(const void *pVect1v, const void *pVect2v, const
 
 #endif
 
+#if defined(USE_AVX2)
+
+// four rows per pass, see L2SqrBatchAVX2
+HNSWLIB_TARGET_AVX2 static void
+InnerProductDistanceBatchAVX2(const void *query, const void *const *rows, size_t n, const void *qty_ptr,
+                              float *out) {
+    const float *q = (const float *) query;
+    size_t qty = *((size_t *) qty_ptr);
+    size_t qty8 = qty >> 3 << 3;
+    float PORTABLE_ALIGN32 TmpRes[4];
+
+    for (size_t i = 0; i < n; i += 4) {
+        const float *r0 = (const float *) rows[i];
+        const float *r1 = (const float *) rows[std::min(i + 1, n - 1)];
+        const float *r2 = (const float *) rows[std::min(i + 2, n - 1)];
+        const float *r3 = (const float *) rows[std::min(i + 3, n - 1)];
+
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        __m256 sum3 = _mm256_setzero_ps();
+        for (size_t j = 0; j < qty8; j += 8) {
+            __m256 v = _mm256_loadu_ps(q + j);
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(r0 + j), v, sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(r1 + j), v, sum1);
+            sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(r2 + j), v, sum2);
+            sum3 = _mm256_fmadd_ps(_mm256_loadu_ps(r3 + j), v, sum3);
+        }
+        __m256 h = _mm256_hadd_ps(_mm256_hadd_ps(sum0, sum1), _mm256_hadd_ps(sum2, sum3));
+        _mm_store_ps(TmpRes, _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1)));
+
+        for (size_t j = qty8; j < qty; j++) {
+            TmpRes[0] += r0[j] * q[j];
+            TmpRes[1] += r1[j] * q[j];
+            TmpRes[2] += r2[j] * q[j];
+            TmpRes[3] += r3[j] * q[j];
+        }
+        for (size_t k = 0; k < 4 && i + k < n; k++) out[i + k] = 1.0f - TmpRes[k];
+    }
+}
+
+#endif
+
+#if defined(USE_AVX512)
+
+HNSWLIB_TARGET_AVX512 static void
+InnerProductDistanceBatchAVX512(const void *query, const void *const *rows, size_t n, const void *qty_ptr,
+                                float *out) {
+    const float *q = (const float *) query;
+    size_t qty = *((size_t *) qty_ptr);
+    size_t qty16 = qty >> 4 << 4;
+    __mmask16 tail = (__mmask16) ((1u << (qty - qty16)) - 1);
+
+    for (size_t i = 0; i < n; i += 4) {
+        const float *r0 = (const float *) rows[i];
+        const float *r1 = (const float *) rows[std::min(i + 1, n - 1)];
+        const float *r2 = (const float *) rows[std::min(i + 2, n - 1)];
+        const float *r3 = (const float *) rows[std::min(i + 3, n - 1)];
+
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        __m512 sum2 = _mm512_setzero_ps();
+        __m512 sum3 = _mm512_setzero_ps();
+        for (size_t j = 0; j < qty16; j += 16) {
+            __m512 v = _mm512_loadu_ps(q + j);
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(r0 + j), v, sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(r1 + j), v, sum1);
+            sum2 = _mm512_fmadd_ps(_mm512_loadu_ps(r2 + j), v, sum2);
+            sum3 = _mm512_fmadd_ps(_mm512_loadu_ps(r3 + j), v, sum3);
+        }
+        if (tail) {
+            __m512 v = _mm512_maskz_loadu_ps(tail, q + qty16);
+            sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, r0 + qty16), v, sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, r1 + qty16), v, sum1);
+            sum2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, r2 + qty16), v, sum2);
+            sum3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, r3 + qty16), v, sum3);
+        }
+        float res[4] = {_mm512_reduce_add_ps(sum0), _mm512_reduce_add_ps(sum1),
+                        _mm512_reduce_add_ps(sum2), _mm512_reduce_add_ps(sum3)};
+        for (size_t k = 0; k < 4 && i + k < n; k++) out[i + k] = 1.0f - res[k];
+    }
+}
+
+#endif
+
 #if defined(USE_SSE) || defined(USE_AVX) || defined(USE_AVX512)
 static DISTFUNC<float> InnerProductSIMD16Ext = InnerProductSIMD16ExtSSE;
 static DISTFUNC<float> InnerProductSIMD4Ext = InnerProductSIMD4ExtSSE;
 static DISTFUNC<float> InnerProductDistanceSIMD16Ext = InnerProductDistanceSIMD16ExtSSE;
 static DISTFUNC<float> InnerProductDistanceSIMD4Ext = InnerProductDistanceSIMD4ExtSSE;
 
+// points the kernels above at the widest ones the CPU runs
+static void InnerProductSelectSIMD() {
+#if defined(USE_AVX)
+    if (AVXCapable()) {
+        InnerProductSIMD4Ext = InnerProductSIMD4ExtAVX;
+        InnerProductDistanceSIMD4Ext = InnerProductDistanceSIMD4ExtAVX;
+        InnerProductSIMD16Ext = InnerProductSIMD16ExtAVX;
+        InnerProductDistanceSIMD16Ext = InnerProductDistanceSIMD16ExtAVX;
+    }
+#endif
+#if defined(USE_AVX2)
+    if (AVX2Capable()) {
+        InnerProductSIMD16Ext = InnerProductSIMD16ExtAVX2;
+        InnerProductDistanceSIMD16Ext = InnerProductDistanceSIMD16ExtAVX2;
+    }
+#endif
+#if defined(USE_AVX512)
+    if (AVX512Capable()) {
+        InnerProductSIMD16Ext = InnerProductSIMD16ExtAVX512;
+        InnerProductDistanceSIMD16Ext = InnerProductDistanceSIMD16ExtAVX512;
+    }
+#endif
+}
+
+static DISTFUNC_BATCH<float> InnerProductDistanceBatchBest() {
+#if defined(USE_AVX512)
+    if (AVX512Capable())
+        return InnerProductDistanceBatchAVX512;
+#endif
+#if defined(USE_AVX2)
+    if (AVX2Capable())
+        return InnerProductDistanceBatchAVX2;
+#endif
+    return nullptr;
+}
+
 static float
 InnerProductDistanceSIMD16ExtResiduals(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
     size_t qty = *((size_t *) qty_ptr);
@@ -341,6 +499,7 @@ InnerProductDistanceSIMD4ExtResiduals(const void *pVect1v, const void *pVect2v,
 
 class InnerProductSpace : public SpaceInterface<float> {
     DISTFUNC<float> fstdistfunc_;
+    DISTFUNC_BATCH<float> fstdistfunc_batch_{nullptr};
     size_t data_size_;
     size_t dim_;
 
@@ -348,26 +507,8 @@ class InnerProductSpace : public SpaceInterface<float> {
     InnerProductSpace(size_t dim) {
         fstdistfunc_ = InnerProductDistance;
 #if defined(USE_AVX) || defined(USE_SSE) || defined(USE_AVX512)
-    #if defined(USE_AVX512)
-        if (AVX512Capable()) {
-            InnerProductSIMD16Ext = InnerProductSIMD16ExtAVX512;
-            InnerProductDistanceSIMD16Ext = InnerProductDistanceSIMD16ExtAVX512;
-        } else if (AVXCapable()) {
-            InnerProductSIMD16Ext = InnerProductSIMD16ExtAVX;
-            InnerProductDistanceSIMD16Ext = InnerProductDistanceSIMD16ExtAVX;
-        }
-    #elif defined(USE_AVX)
-        if (AVXCapable()) {
-            InnerProductSIMD16Ext = InnerProductSIMD16ExtAVX;
-            InnerProductDistanceSIMD16Ext = InnerProductDistanceSIMD16ExtAVX;
-        }
-    #endif
-    #if defined(USE_AVX)
-        if (AVXCapable()) {
-            InnerProductSIMD4Ext = InnerProductSIMD4ExtAVX;
-            InnerProductDistanceSIMD4Ext = InnerProductDistanceSIMD4ExtAVX;
-        }
-    #endif
+        InnerProductSelectSIMD();
+        fstdistfunc_batch_ = InnerProductDistanceBatchBest();
 
         if (dim % 16 == 0)
             fstdistfunc_ = InnerProductDistanceSIMD16Ext;
@@ -394,6 +535,10 @@ class InnerProductSpace : public SpaceInterface<float> {
         return &dim_;
     }
 
+    DISTFUNC_BATCH<float> get_dist_func_batch() {
+        return fstdistfunc_batch_;
+    }
+
 ~InnerProductSpace() {}
 };
 
@@ -22,7 +22,7 @@ L2Sqr(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
 #if defined(USE_AVX512)
 
 // Favor using AVX512 if available.
-static float
+HNSWLIB_TARGET_AVX512 static float
 L2SqrSIMD16ExtAVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
     float *pVect1 = (float *) pVect1v;
     float *pVect2 = (float *) pVect2v;
@@ -41,8 +41,7 @@ L2SqrSIMD16ExtAVX512(const void *pVect1v, const void *pVect2v, const void *qty_p
         v2 = _mm512_loadu_ps(pVect2);
         pVect2 += 16;
         diff = _mm512_sub_ps(v1, v2);
-        // sum = _mm512_fmadd_ps(diff, diff, sum);
-        sum = _mm512_add_ps(sum, _mm512_mul_ps(diff, diff));
+        sum = _mm512_fmadd_ps(diff, diff, sum);
     }
 
     _mm512_store_ps(TmpRes, sum);
@@ -57,7 +56,7 @@ L2SqrSIMD16ExtAVX512(const void *pVect1v, const void *pVect2v, const void *qty_p
 #if defined(USE_AVX)
 
 // Favor using AVX if available.
-static float
+HNSWLIB_TARGET_AVX static float
 L2SqrSIMD16ExtAVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
     float *pVect1 = (float *) pVect1v;
     float *pVect2 = (float *) pVect2v;
@@ -92,6 +91,38 @@ L2SqrSIMD16ExtAVX(const void *pVect1v, const void *pVect2v, const void *qty_ptr)
 
 #endif
 
+#if defined(USE_AVX2)
+
+// AVX with fused multiply-add, two accumulators to hide the FMA latency.
+HNSWLIB_TARGET_AVX2 static float
+L2SqrSIMD16ExtAVX2(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    float *pVect1 = (float *) pVect1v;
+    float *pVect2 = (float *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+    float PORTABLE_ALIGN32 TmpRes[8];
+    size_t qty16 = qty >> 4;
+
+    const float *pEnd1 = pVect1 + (qty16 << 4);
+
+    __m256 diff0, diff1;
+    __m256 sum0 = _mm256_set1_ps(0);
+    __m256 sum1 = _mm256_set1_ps(0);
+
+    while (pVect1 < pEnd1) {
+        diff0 = _mm256_sub_ps(_mm256_loadu_ps(pVect1), _mm256_loadu_ps(pVect2));
+        diff1 = _mm256_sub_ps(_mm256_loadu_ps(pVect1 + 8), _mm256_loadu_ps(pVect2 + 8));
+        pVect1 += 16;
+        pVect2 += 16;
+        sum0 = _mm256_fmadd_ps(diff0, diff0, sum0);
+        sum1 = _mm256_fmadd_ps(diff1, diff1, sum1);
+    }
+
+    _mm256_store_ps(TmpRes, _mm256_add_ps(sum0, sum1));
+    return TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+}
+
+#endif
+
 #if defined(USE_SSE)
 
 static float
@@ -143,9 +174,135 @@ L2SqrSIMD16ExtSSE(const void *pVect1v, const void *pVect2v, const void *qty_ptr)
 }
 #endif
 
+#if defined(USE_AVX2)
+
+// Batched kernels score four rows per pass: every query chunk is loaded once and the
+// four accumulations are independent. Missing rows of the last pass repeat the last one.
+HNSWLIB_TARGET_AVX2 static void
+L2SqrBatchAVX2(const void *query, const void *const *rows, size_t n, const void *qty_ptr, float *out) {
+    const float *q = (const float *) query;
+    size_t qty = *((size_t *) qty_ptr);
+    size_t qty8 = qty >> 3 << 3;
+    float PORTABLE_ALIGN32 TmpRes[4];
+
+    for (size_t i = 0; i < n; i += 4) {
+        const float *r0 = (const float *) rows[i];
+        const float *r1 = (const float *) rows[std::min(i + 1, n - 1)];
+        const float *r2 = (const float *) rows[std::min(i + 2, n - 1)];
+        const float *r3 = (const float *) rows[std::min(i + 3, n - 1)];
+
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        __m256 sum3 = _mm256_setzero_ps();
+        for (size_t j = 0; j < qty8; j += 8) {
+            __m256 v = _mm256_loadu_ps(q + j);
+            __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(r0 + j), v);
+            __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(r1 + j), v);
+            __m256 diff2 = _mm256_sub_ps(_mm256_loadu_ps(r2 + j), v);
+            __m256 diff3 = _mm256_sub_ps(_mm256_loadu_ps(r3 + j), v);
+            sum0 = _mm256_fmadd_ps(diff0, diff0, sum0);
+            sum1 = _mm256_fmadd_ps(diff1, diff1, sum1);
+            sum2 = _mm256_fmadd_ps(diff2, diff2, sum2);
+            sum3 = _mm256_fmadd_ps(diff3, diff3, sum3);
+        }
+        __m256 h = _mm256_hadd_ps(_mm256_hadd_ps(sum0, sum1), _mm256_hadd_ps(sum2, sum3));
+        _mm_store_ps(TmpRes, _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1)));
+
+        for (size_t j = qty8; j < qty; j++) {
+            float t0 = r0[j] - q[j], t1 = r1[j] - q[j], t2 = r2[j] - q[j], t3 = r3[j] - q[j];
+            TmpRes[0] += t0 * t0;
+            TmpRes[1] += t1 * t1;
+            TmpRes[2] += t2 * t2;
+            TmpRes[3] += t3 * t3;
+        }
+        for (size_t k = 0; k < 4 && i + k < n; k++) out[i + k] = TmpRes[k];
+    }
+}
+
+#endif
+
+#if defined(USE_AVX512)
+
+HNSWLIB_TARGET_AVX512 static void
+L2SqrBatchAVX512(const void *query, const void *const *rows, size_t n, const void *qty_ptr, float *out) {
+    const float *q = (const float *) query;
+    size_t qty = *((size_t *) qty_ptr);
+    size_t qty16 = qty >> 4 << 4;
+    __mmask16 tail = (__mmask16) ((1u << (qty - qty16)) - 1);
+
+    for (size_t i = 0; i < n; i += 4) {
+        const float *r0 = (const float *) rows[i];
+        const float *r1 = (const float *) rows[std::min(i + 1, n - 1)];
+        const float *r2 = (const float *) rows[std::min(i + 2, n - 1)];
+        const float *r3 = (const float *) rows[std::min(i + 3, n - 1)];
+
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        __m512 sum2 = _mm512_setzero_ps();
+        __m512 sum3 = _mm512_setzero_ps();
+        for (size_t j = 0; j < qty16; j += 16) {
+            __m512 v = _mm512_loadu_ps(q + j);
+            __m512 diff0 = _mm512_sub_ps(_mm512_loadu_ps(r0 + j), v);
+            __m512 diff1 = _mm512_sub_ps(_mm512_loadu_ps(r1 + j), v);
+            __m512 diff2 = _mm512_sub_ps(_mm512_loadu_ps(r2 + j), v);
+            __m512 diff3 = _mm512_sub_ps(_mm512_loadu_ps(r3 + j), v);
+            sum0 = _mm512_fmadd_ps(diff0, diff0, sum0);
+            sum1 = _mm512_fmadd_ps(diff1, diff1, sum1);
+            sum2 = _mm512_fmadd_ps(diff2, diff2, sum2);
+            sum3 = _mm512_fmadd_ps(diff3, diff3, sum3);
+        }
+        if (tail) {
+            __m512 v = _mm512_maskz_loadu_ps(tail, q + qty16);
+            __m512 diff0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, r0 + qty16), v);
+            __m512 diff1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, r1 + qty16), v);
+            __m512 diff2 = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, r2 + qty16), v);
+            __m512 diff3 = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, r3 + qty16), v);
+            sum0 = _mm512_fmadd_ps(diff0, diff0, sum0);
+            sum1 = _mm512_fmadd_ps(diff1, diff1, sum1);
+            sum2 = _mm512_fmadd_ps(diff2, diff2, sum2);
+            sum3 = _mm512_fmadd_ps(diff3, diff3, sum3);
+        }
+        float res[4] = {_mm512_reduce_add_ps(sum0), _mm512_reduce_add_ps(sum1),
+                        _mm512_reduce_add_ps(sum2), _mm512_reduce_add_ps(sum3)};
+        for (size_t k = 0; k < 4 && i + k < n; k++) out[i + k] = res[k];
+    }
+}
+
+#endif
+
 #if defined(USE_SSE) || defined(USE_AVX) || defined(USE_AVX512)
 static DISTFUNC<float> L2SqrSIMD16Ext = L2SqrSIMD16ExtSSE;
 
+// widest 16-float kernel the CPU runs
+static DISTFUNC<float> L2SqrSIMD16ExtBest() {
+#if defined(USE_AVX512)
+    if (AVX512Capable())
+        return L2SqrSIMD16ExtAVX512;
+#endif
+#if defined(USE_AVX2)
+    if (AVX2Capable())
+        return L2SqrSIMD16ExtAVX2;
+#endif
+#if defined(USE_AVX)
+    if (AVXCapable())
+        return L2SqrSIMD16ExtAVX;
+#endif
+    return L2SqrSIMD16ExtSSE;
+}
+
+static DISTFUNC_BATCH<float> L2SqrBatchBest() {
+#if defined(USE_AVX512)
+    if (AVX512Capable())
+        return L2SqrBatchAVX512;
+#endif
+#if defined(USE_AVX2)
+    if (AVX2Capable())
+        return L2SqrBatchAVX2;
+#endif
+    return nullptr;
+}
+
 static float
 L2SqrSIMD16ExtResiduals(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
     size_t qty = *((size_t *) qty_ptr);
@@ -207,6 +364,7 @@ L2SqrSIMD4ExtResiduals(const void *pVect1v, const void *pVect2v, const void *qty
 
 class L2Space : public SpaceInterface<float> {
     DISTFUNC<float> fstdistfunc_;
+    DISTFUNC_BATCH<float> fstdistfunc_batch_{nullptr};
     size_t data_size_;
     size_t dim_;
 
@@ -214,15 +372,8 @@ class L2Space : public SpaceInterface<float> {
     L2Space(size_t dim) {
         fstdistfunc_ = L2Sqr;
 #if defined(USE_SSE) || defined(USE_AVX) || defined(USE_AVX512)
-    #if defined(USE_AVX512)
-        if (AVX512Capable())
-            L2SqrSIMD16Ext = L2SqrSIMD16ExtAVX512;
-        else if (AVXCapable())
-            L2SqrSIMD16Ext = L2SqrSIMD16ExtAVX;
-    #elif defined(USE_AVX)
-        if (AVXCapable())
-            L2SqrSIMD16Ext = L2SqrSIMD16ExtAVX;
-    #endif
+        L2SqrSIMD16Ext = L2SqrSIMD16ExtBest();
+        fstdistfunc_batch_ = L2SqrBatchBest();
 
         if (dim % 16 == 0)
             fstdistfunc_ = L2SqrSIMD16Ext;
@@ -249,6 +400,10 @@ class L2Space : public SpaceInterface<float> {
         return &dim_;
     }
 
+    DISTFUNC_BATCH<float> get_dist_func_batch() {
+        return fstdistfunc_batch_;
+    }
+
     ~L2Space() {}
 };
 
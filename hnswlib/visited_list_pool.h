@@ -16,13 +16,14 @@ class VisitedList {
     VisitedList(int numelements1) {
         curV = -1;
         numelements = numelements1;
-        mass = new vl_type[numelements];
+        // one spare tag so that 32-bit gathers of the last tag stay inside the array
+        mass = new vl_type[numelements + 1];
     }
 
     void reset() {
         curV++;
         if (curV == 0) {
-            memset(mass, 0, sizeof(vl_type) * numelements);
+            memset(mass, 0, sizeof(vl_type) * (numelements + 1));
             curV++;
         }
     }
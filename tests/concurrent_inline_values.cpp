@@ -0,0 +1,68 @@
+// concurrent_inline_values.cpp - range queries on an index with inline values while other
+// threads insert. Inserts rewrite link lists the queries read without locks, a query must
+// still never return a point whose value lies outside its range.
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+
+#include "../TreeHNSW.hpp"
+
+using namespace std;
+
+int main() {
+    const int dim = 16, baseNum = 2000, maxNum = 8000, k = 10, writers = 4, readers = 4;
+
+    mt19937 gen(7);
+    uniform_real_distribution<float> unit(0, 1);
+    vector<float> data((size_t)maxNum * dim);
+    for (auto &x : data) x = unit(gen);
+    vector<int> keys(maxNum), values(maxNum);
+    for (int i = 0; i < maxNum; i++) {
+        keys[i] = i;
+        values[i] = gen() % maxNum;
+    }
+
+    RangeHNSW index(dim, baseNum, maxNum, data.data(), keys.data(), values.data(), 16, 100);
+    index.enableInlineValues();
+
+    atomic<int> next{baseNum};
+    atomic<bool> stop{false};
+    atomic<long> queries{0}, outside{0};
+
+    vector<thread> readerThreads;
+    for (int t = 0; t < readers; t++) {
+        readerThreads.emplace_back([&, t] {
+            mt19937 qgen(t);
+            vector<float> query(dim);
+            while (!stop) {
+                for (auto &x : query) x = unit(qgen);
+                int rangeL = qgen() % maxNum;
+                int rangeR = rangeL + (int)(qgen() % (maxNum / 4));
+                auto top = index.queryRange(query.data(), rangeL, rangeR, k, 50);
+                while (!top.empty()) {
+                    int value = values[top.top().second];
+                    if (value < rangeL || value > rangeR) outside++;
+                    top.pop();
+                }
+                queries++;
+            }
+        });
+    }
+
+    vector<thread> writerThreads;
+    for (int t = 0; t < writers; t++) {
+        writerThreads.emplace_back([&] {
+            for (int i; (i = next++) < maxNum; )
+                index.addPoint(keys[i], values[i], (char *)(data.data() + (size_t)i * dim));
+        });
+    }
+    for (auto &w : writerThreads) w.join();
+    stop = true;
+    for (auto &r : readerThreads) r.join();
+
+    cout << "queries: " << queries << ", results outside their range: " << outside << endl;
+    return outside == 0 ? 0 : 1;
+}
@@ -3,26 +3,211 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
 
-void load_data(const char* filename, float*& data, int num, int dim) {
-    std::ifstream in(filename, std::ios::binary);
-    if (!in.is_open()) {
-        std::cout << "open file error" << std::endl;
-        exit(-1);
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// .fvecs / .bvecs rows are a 4 byte dimension followed by the float / uint8 components,
+// .fbin / .u8bin files are a uint32 count and dimension followed by the rows
+enum class VectorFormat { Fvecs, Bvecs, Fbin, U8bin };
+
+VectorFormat vector_format(const std::string &filename) {
+    auto endsWith = [&](const char *suffix) {
+        size_t n = strlen(suffix);
+        return filename.size() >= n && filename.compare(filename.size() - n, n, suffix) == 0;
+    };
+    if (endsWith(".bvecs")) return VectorFormat::Bvecs;
+    if (endsWith(".fbin")) return VectorFormat::Fbin;
+    if (endsWith(".u8bin")) return VectorFormat::U8bin;
+    return VectorFormat::Fvecs;
+}
+
+// Loads all vectors of filename, format by extension, into a new[] float buffer and returns
+// their number and dimension. The file is mapped and its rows are converted by all OpenMP
+// threads. On failure prints the reason and returns false with data left null.
+bool load_vectors(const char* filename, float*& data, size_t& num, int& dim) {
+    data = nullptr;
+    VectorFormat format = vector_format(filename);
+    size_t elemSize = (format == VectorFormat::Bvecs || format == VectorFormat::U8bin) ? 1 : 4;
+    bool rowHeaders = format == VectorFormat::Fvecs || format == VectorFormat::Bvecs;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "open file error: " << filename << std::endl;
+        return false;
+    }
+    struct stat st;
+    size_t fsize = fstat(fd, &st) == 0 ? st.st_size : 0;
+    if (fsize < 8) {
+        std::cerr << "file too small: " << filename << std::endl;
+        close(fd);
+        return false;
     }
-    in.read((char*)&dim, 4);
-    in.seekg(0, std::ios::end);	
-    std::ios::pos_type ss = in.tellg();
-    size_t fsize = (size_t)ss;
-    num = (unsigned)(fsize / (dim + 1) / 4);	
-    data = new float[(size_t)num * (size_t)dim];
+    char *base = (char *) mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        std::cerr << "mmap error: " << filename << std::endl;
+        return false;
+    }
+    madvise(base, fsize, MADV_SEQUENTIAL);
+
+    // vector i starts at offset + i * rowBytes
+    size_t rowBytes, offset;
+    if (rowHeaders) {
+        memcpy(&dim, base, 4);
+        rowBytes = 4 + (size_t) dim * elemSize;
+        offset = 4;
+        num = dim > 0 ? fsize / rowBytes : 0;
+    } else {
+        uint32_t header[2];
+        memcpy(header, base, 8);
+        num = header[0];
+        dim = header[1];
+        rowBytes = (size_t) dim * elemSize;
+        offset = 8;
+    }
+    bool valid = dim > 0 && (rowHeaders ? fsize % rowBytes == 0 : fsize >= offset + num * rowBytes);
+
+    if (valid) {
+        data = new float[num * dim];
+        // static chunks keep every thread on a sequential stretch of the file, and place the
+        // pages of the buffer next to the thread that uses them first
+#pragma omp parallel for schedule(static) reduction(&&:valid)
+        for (size_t i = 0; i < num; i++) {
+            const char *row = base + offset + i * rowBytes;
+            float *out = data + i * dim;
+            if (rowHeaders && memcmp(row - 4, &dim, 4) != 0) valid = false;
+            else if (elemSize == 4) memcpy(out, row, (size_t) dim * 4);
+            else {
+                const uint8_t *bytes = (const uint8_t *) row;
+                for (int j = 0; j < dim; j++) out[j] = bytes[j];
+            }
+        }
+    }
+    munmap(base, fsize);
+    if (!valid) {
+        std::cerr << "corrupted vector file: " << filename << std::endl;
+        delete[] data;
+        data = nullptr;
+        return false;
+    }
+    return true;
+}
+
+// Binary attribute file: a header and then the key column and the value column, each of
+// count little endian int32 or int64 entries. Loaders still accept the "key value" text format.
+#define ATTRIBUTE_FILE_MAGIC 0x54414744   // "DGAT"
+#define ATTRIBUTE_FILE_VERSION 1
+
+struct AttributeFileHeader {
+    uint32_t magic, version;
+    uint64_t count;
+    uint32_t keyBytes, valueBytes;   // 4 or 8
+};
 
-    in.seekg(0, std::ios::beg);
+bool save_attributes(const char* filename, const int* keys, const int* values, size_t num) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "open file error: " << filename << std::endl;
+        return false;
+    }
+    AttributeFileHeader header{ATTRIBUTE_FILE_MAGIC, ATTRIBUTE_FILE_VERSION, num, 4, 4};
+    out.write((const char *) &header, sizeof(header));
+    out.write((const char *) keys, num * sizeof(int));
+    out.write((const char *) values, num * sizeof(int));
+    return out.good();
+}
+
+// copies a mapped column of int32 or int64 entries, false if an entry does not fit an int
+bool read_attribute_column(const char* column, uint32_t bytes, size_t num, int* out) {
+    if (bytes == 4) {
+        memcpy(out, column, num * sizeof(int));
+        return true;
+    }
+    bool fits = true;
+#pragma omp parallel for schedule(static) reduction(&&:fits)
     for (size_t i = 0; i < num; i++) {
-        in.seekg(4, std::ios::cur);	
-        in.read((char*)(data + i * dim), dim * 4);	
+        int64_t v;
+        memcpy(&v, column + i * 8, 8);
+        out[i] = (int) v;
+        if (v != out[i]) fits = false;
+    }
+    return fits;
+}
+
+// Loads the keys and values of a binary or text attribute file into new[] arrays.
+// On failure prints the reason and returns false with both arrays left null.
+bool load_attributes(const char* filename, int*& keys, int*& values, size_t& num) {
+    keys = values = nullptr;
+    num = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "open file error: " << filename << std::endl;
+        return false;
+    }
+    struct stat st;
+    size_t fsize = fstat(fd, &st) == 0 ? st.st_size : 0;
+    AttributeFileHeader header;
+    bool binary = fsize >= sizeof(header) && pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+                  header.magic == ATTRIBUTE_FILE_MAGIC;
+    if (!binary) {
+        close(fd);
+        std::ifstream in(filename);
+        std::vector<int> k, v;
+        int key, value;
+        while (in >> key >> value) {
+            k.push_back(key);
+            v.push_back(value);
+        }
+        num = k.size();
+        keys = new int[num];
+        values = new int[num];
+        std::copy(k.begin(), k.end(), keys);
+        std::copy(v.begin(), v.end(), values);
+        return true;
+    }
+
+    bool valid = header.version == ATTRIBUTE_FILE_VERSION &&
+                 (header.keyBytes == 4 || header.keyBytes == 8) && (header.valueBytes == 4 || header.valueBytes == 8) &&
+                 (fsize - sizeof(header)) / (header.keyBytes + header.valueBytes) >= header.count;
+    char *base = valid ? (char *) mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0) : (char *) MAP_FAILED;
+    close(fd);
+    if (base != MAP_FAILED) {
+        num = header.count;
+        keys = new int[num];
+        values = new int[num];
+        const char *keyColumn = base + sizeof(header);
+        valid = read_attribute_column(keyColumn, header.keyBytes, num, keys) &&
+                read_attribute_column(keyColumn + num * header.keyBytes, header.valueBytes, num, values);
+        munmap(base, fsize);
+    }
+    else valid = false;
+    if (!valid) {
+        std::cerr << "corrupted attribute file: " << filename << std::endl;
+        delete[] keys;
+        delete[] values;
+        keys = values = nullptr;
+        num = 0;
+        return false;
+    }
+    return true;
+}
+
+// num and dim are taken from the file
+void load_data(const char* filename, float*& data, int num, int dim) {
+    size_t n;
+    if (!load_vectors(filename, data, n, dim)) {
+        std::cout << "open file error" << std::endl;
+        exit(-1);
     }
-    in.close();
 }
 
 